@@ -63,6 +63,9 @@ include $(multirom_local_path)/trampoline/Android.mk
 # fw_mounter
 include $(multirom_local_path)/fw_mounter/Android.mk
 
+# animation list benchmark, host only
+include $(multirom_local_path)/anim_benchmark/Android.mk
+
 # ZIP installer
 include $(multirom_local_path)/install_zip/Android.mk
 
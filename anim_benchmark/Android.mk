@@ -0,0 +1,16 @@
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+# Host benchmark of the animation list, "make multirom_anim_benchmark"
+LOCAL_C_INCLUDES += $(multirom_local_path)/lib
+LOCAL_SRC_FILES:= \
+    anim_benchmark.c \
+    ../lib/containers.c \
+    ../lib/mrom_data.c \
+
+LOCAL_MODULE := multirom_anim_benchmark
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -DLOG_TO_STDOUT
+LOCAL_LDLIBS += -lm -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,169 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark of the animation list. animation.c is built into it
+// directly, so that the list internals can be checked, with the
+// framebuffer and worker thread left out.
+
+#include <stdint.h>
+#include <time.h>
+
+#include "../lib/animation.c"
+
+uint32_t fb_width = 1080;
+uint32_t fb_height = 1920;
+
+void fb_request_draw(void) { }
+void fb_remove_item(UNUSED void *item) { }
+void fb_set_frame_callback(UNUSED fb_frame_callback call, UNUSED void *data) { }
+void workers_add(UNUSED worker_call call, UNUSED void *data) { }
+void workers_remove(UNUSED worker_call call, UNUSED void *data) { }
+
+void *mzalloc(size_t size)
+{
+    return calloc(1, size);
+}
+
+int imax(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+uint32_t timespec_diff(struct timespec *f, struct timespec *s)
+{
+    return (s->tv_sec - f->tv_sec)*1000 + (s->tv_nsec - f->tv_nsec)/1000000;
+}
+
+#define ANIM_BENCH_CNT 1000
+
+static int64_t anim_bench_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)*1000000LL + (now.tv_nsec - start->tv_nsec)/1000;
+}
+
+static int anim_bench_cancel_check(void *data, void *item)
+{
+    return data == item;
+}
+
+// Fills the list with ANIM_BENCH_CNT item animations, one per item
+static void anim_bench_fill(fb_item_header *items, uint32_t *ids, uint32_t start_offset)
+{
+    int i;
+    item_anim *anim;
+
+    for(i = 0; i < ANIM_BENCH_CNT; ++i)
+    {
+        anim = item_anim_create(&items[i], 1000, i % INTERPOLATOR_CNT);
+        anim->start_offset = start_offset;
+        anim->targetX = i;
+        ids[i] = anim->id;
+        item_anim_add(anim);
+    }
+}
+
+// Measures the list operations with ANIM_BENCH_CNT animations and checks
+// that the index finds every one of them. Returns 0 if it does.
+static int anim_benchmark(void)
+{
+    fb_item_header *items = mzalloc(ANIM_BENCH_CNT*sizeof(fb_item_header));
+    uint32_t *ids = mzalloc(ANIM_BENCH_CNT*sizeof(uint32_t));
+    struct anim_list_it *it;
+    struct timespec start;
+    int64_t t_add, t_cancel, t_cancel_for, t_walk, t_tick;
+    uint32_t left;
+    int i, found = 0, res = -1;
+    call_anim *custom;
+
+    // anim_cancel by id
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    anim_bench_fill(items, ids, UINT32_MAX);
+    t_add = anim_bench_us(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ANIM_BENCH_CNT; ++i)
+        anim_cancel(ids[i], 0);
+    t_cancel = anim_bench_us(&start);
+    left = anim_list.index.count;
+
+    // anim_cancel_for, the way fb_remove_item calls it
+    anim_bench_fill(items, ids, UINT32_MAX);
+
+    // what anim_cancel_for did before the index: ask every animation
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&anim_list.mutex);
+    for(i = 0; i < ANIM_BENCH_CNT; ++i)
+        for(it = anim_list.first; it; it = it->next)
+            if(it->anim->cancel_check && it->anim->cancel_check(it->anim->cancel_check_data, &items[i]))
+                ++found;
+    pthread_mutex_unlock(&anim_list.mutex);
+    t_walk = anim_bench_us(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ANIM_BENCH_CNT; ++i)
+        anim_cancel_for(&items[i], 0);
+    t_cancel_for = anim_bench_us(&start);
+    left += anim_list.index.count;
+
+    // one tick with all of them running, plus an animation with its own
+    // cancel check which has to survive the cancels of other items
+    anim_bench_fill(items, ids, 0);
+    custom = call_anim_create(NULL, NULL, 1000, INTERPOLATOR_LINEAR);
+    custom->cancel_check = anim_bench_cancel_check;
+    custom->cancel_check_data = &items[0];
+    call_anim_add(custom);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    anim_update(16, &anim_list);
+    t_tick = anim_bench_us(&start);
+
+    for(i = 1; i < ANIM_BENCH_CNT; ++i)
+        anim_cancel_for(&items[i], 0);
+    if(anim_list.index.count != 2 || anim_list.index.custom_checks != 1)
+        ERROR("anim benchmark: %u animations and %u custom checks left, expected 2 and 1\n",
+                anim_list.index.count, anim_list.index.custom_checks);
+    anim_cancel_for(&items[0], 0);
+    left += anim_list.index.count + anim_list.index.custom_checks;
+
+    INFO("anim benchmark (%d animations): add %lldus, anim_cancel %lldus, "
+            "anim_cancel_for %lldus (list walk %lldus), tick %lldus\n", ANIM_BENCH_CNT,
+            (long long)t_add, (long long)t_cancel, (long long)t_cancel_for, (long long)t_walk, (long long)t_tick);
+
+    if(left != 0 || found != ANIM_BENCH_CNT)
+        ERROR("anim benchmark: index lost animations (%u left, %d found by walk)\n", left, found);
+    else
+        res = 0;
+
+    free(items);
+    free(ids);
+    return res;
+}
+
+int main(void)
+{
+    int res;
+
+    mrom_set_log_tag("anim_benchmark");
+
+    // the stepper is a no-op here, anim_update is called directly
+    anim_init(1.f);
+    res = anim_benchmark();
+    anim_stop(0);
+    return res == 0 ? 0 : 1;
+}
@@ -89,6 +89,12 @@ ifeq ($(MR_KEXEC_DTB),true)
     LOCAL_CFLAGS += -DMR_KEXEC_DTB
 endif
 
+# Load Android ROMs with kexec_file_load straight from memory when the
+# kernel supports it. That is plain kexec, not hardboot.
+ifeq ($(MR_KEXEC_FILE_LOAD),true)
+    LOCAL_CFLAGS += -DMR_KEXEC_FILE_LOAD
+endif
+
 ifeq ($(MR_CONTINUOUS_FB_UPDATE),true)
     LOCAL_CFLAGS += -DMR_CONTINUOUS_FB_UPDATE
 endif
@@ -18,6 +18,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 
 #include "kexec.h"
 #include "lib/containers.h"
@@ -31,6 +35,7 @@
 void kexec_init(struct kexec *k, const char *path)
 {
     k->args = NULL;
+    k->loaded = 0;
     kexec_add_arg(k, path);
 }
 
@@ -43,6 +48,12 @@ int kexec_load_exec(struct kexec *k)
 {
     int i, len;
 
+    if(k->loaded)
+    {
+        INFO("Kexec already loaded in-process\n");
+        return 0;
+    }
+
     INFO("Loading kexec:\n");
     for(i = 0; k->args && k->args[i]; ++i)
     {
@@ -112,3 +123,125 @@ void kexec_add_kernel(struct kexec *k, const char *path, int hardboot)
         kexec_add_arg(k, "-l");
     kexec_add_arg(k, path);
 }
+
+#if defined(__NR_kexec_file_load) && defined(__NR_memfd_create)
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static int kexec_memfd(const char *name, const void *data, size_t size)
+{
+    const char *itr = data;
+    ssize_t w;
+
+    // run_cmd forks busybox and ntfs-3g, they must not inherit it
+    int fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    while(size > 0)
+    {
+        w = write(fd, itr, size);
+        if(w <= 0)
+        {
+            if(w < 0 && errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        itr += w;
+        size -= w;
+    }
+    return fd;
+}
+#endif
+
+#if defined(__NR_kexec_file_load)
+static int kexec_file_load_fds(struct kexec *k, int kernel_fd, int initrd_fd, const char *cmdline)
+{
+    INFO("Loading kexec in-process:\n    %s\n", cmdline);
+
+    // KEXEC_FILE_NO_INITRAMFS = 0x4
+    if(syscall(__NR_kexec_file_load, kernel_fd, initrd_fd, strlen(cmdline)+1, cmdline,
+            initrd_fd < 0 ? 0x4 : 0) < 0)
+    {
+        ERROR("kexec_file_load failed (%d: %s)\n", errno, strerror(errno));
+        return -1;
+    }
+
+    k->loaded = 1;
+    return 0;
+}
+#endif
+
+// Loads kernel and initrd straight from memory with kexec_file_load,
+// so nothing has to be dumped to rootfs and the kexec binary isn't run.
+// Returns -1 if the kernel can't do that, caller should fall back
+// to the kexec binary then.
+int kexec_file_load_mem(struct kexec *k, const void *kernel, size_t kernel_size,
+        const void *initrd, size_t initrd_size, const char *cmdline)
+{
+#if defined(__NR_kexec_file_load) && defined(__NR_memfd_create)
+    int res = -1;
+    int initrd_fd = -1;
+    int kernel_fd = kexec_memfd("kexec_kernel", kernel, kernel_size);
+    if(kernel_fd < 0)
+    {
+        ERROR("kexec_file_load: failed to create memfd for kernel (%d: %s)\n", errno, strerror(errno));
+        return -1;
+    }
+
+    if(initrd && initrd_size)
+    {
+        initrd_fd = kexec_memfd("kexec_initrd", initrd, initrd_size);
+        if(initrd_fd < 0)
+        {
+            ERROR("kexec_file_load: failed to create memfd for initrd (%d: %s)\n", errno, strerror(errno));
+            goto exit;
+        }
+    }
+
+    res = kexec_file_load_fds(k, kernel_fd, initrd_fd, cmdline);
+exit:
+    if(initrd_fd >= 0)
+        close(initrd_fd);
+    close(kernel_fd);
+    return res;
+#else
+    return -1;
+#endif
+}
+
+// Same as kexec_file_load_mem, but with kernel and initrd in files
+int kexec_file_load_path(struct kexec *k, const char *kernel, const char *initrd, const char *cmdline)
+{
+#if defined(__NR_kexec_file_load)
+    int res = -1;
+    int initrd_fd = -1;
+    int kernel_fd = open(kernel, O_RDONLY | O_CLOEXEC);
+    if(kernel_fd < 0)
+    {
+        ERROR("kexec_file_load: failed to open %s (%d: %s)\n", kernel, errno, strerror(errno));
+        return -1;
+    }
+
+    if(initrd)
+    {
+        initrd_fd = open(initrd, O_RDONLY | O_CLOEXEC);
+        if(initrd_fd < 0)
+        {
+            ERROR("kexec_file_load: failed to open %s (%d: %s)\n", initrd, errno, strerror(errno));
+            goto exit;
+        }
+    }
+
+    res = kexec_file_load_fds(k, kernel_fd, initrd_fd, cmdline);
+exit:
+    if(initrd_fd >= 0)
+        close(initrd_fd);
+    close(kernel_fd);
+    return res;
+#else
+    return -1;
+#endif
+}
@@ -18,9 +18,12 @@
 #ifndef KEXEC_H
 #define KEXEC_H
 
+#include <stddef.h>
+
 struct kexec
 {
     char **args;
+    int loaded; // already loaded in-process, the kexec binary is not needed
 };
 
 void kexec_init(struct kexec *k, const char *path);
@@ -29,5 +32,8 @@ int kexec_load_exec(struct kexec *k);
 void kexec_add_arg(struct kexec *k, const char *arg);
 void kexec_add_arg_prefix(struct kexec *k, const char *prefix, const char *value);
 void kexec_add_kernel(struct kexec *k, const char *path, int hardboot);
+int kexec_file_load_mem(struct kexec *k, const void *kernel, size_t kernel_size,
+        const void *initrd, size_t initrd_size, const char *cmdline);
+int kexec_file_load_path(struct kexec *k, const char *kernel, const char *initrd, const char *cmdline);
 
 #endif
@@ -2,9 +2,11 @@ LOCAL_PATH:= $(call my-dir)
 
 common_SRC_FILES := \
     animation.c \
+    blkprobe.c \
     button.c \
     colors.c \
     containers.c \
+    cpio.c \
     framebuffer.c \
     framebuffer_generic.c \
     framebuffer_png.c \
@@ -13,6 +15,7 @@ common_SRC_FILES := \
     inject.c \
     input.c \
     listview.c \
+    lz4.c \
     keyboard.c \
     mrom_data.c \
     notification_card.c \
@@ -37,6 +40,11 @@ ifeq ($(MR_INPUT_TYPE),)
 endif
 common_SRC_FILES += input_$(MR_INPUT_TYPE).c
 
+ifeq ($(MR_INPUT_LATENCY),true)
+    common_C_FLAGS += -DMR_INPUT_LATENCY
+    common_SRC_FILES += input_latency.c
+endif
+
 ifeq ($(MR_USE_QCOM_OVERLAY),true)
     common_C_FLAGS += -DMR_USE_QCOM_OVERLAY
     common_SRC_FILES += framebuffer_qcom_overlay.c
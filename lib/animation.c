@@ -16,6 +16,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <math.h>
@@ -27,53 +28,219 @@
 #include "framebuffer.h"
 #include "containers.h"
 
+#define INTERPOLATOR_CNT (INTERPOLATOR_ACCEL_DECEL+1)
+
 struct anim_list_it
 {
     int anim_type;
     anim_header *anim;
 
+    int stepped;
+    int finished; // removed once its queued callbacks have run
+    float interpolated;
+
     struct anim_list_it *prev;
     struct anim_list_it *next;
+
+    // chains in the anim_index buckets
+    struct anim_list_it *id_prev;
+    struct anim_list_it *id_next;
+    int custom_check; // counted in anim_index.custom_checks
+    void *item;
+    struct anim_list_it *item_prev;
+    struct anim_list_it *item_next;
+};
+
+// Looks up animations by id and by the fb item they are cancelled with,
+// so that neither anim_cancel nor fb item teardown has to walk the list.
+struct anim_index
+{
+    struct anim_list_it **id_buckets;
+    struct anim_list_it **item_buckets;
+    uint32_t bucket_cnt; // power of two
+    uint32_t count;
+    uint32_t custom_checks; // animations with cancel_check other than anim_item_cancel_check
+};
+
+struct anim_ctx
+{
+    struct anim_list_it *first;
+    struct anim_list_it *last;
+    struct anim_index index;
+};
+
+// running animations of one interpolator, gathered each tick
+struct anim_batch
+{
+    struct anim_list_it **its;
+    float *normalized;
+    float *interpolated;
+    int count;
+    int alloc;
+};
+
+struct anim_call
+{
+    uint32_t id;
+    int dropped; // the animation was cancelled before the call ran, atomic
+    animation_callback_step step;
+    animation_callback call;
+    void *data;
+    float interpolated;
 };
 
 struct anim_list
 {
     struct anim_list_it *first;
     struct anim_list_it *last;
+    struct anim_index index;
 
-    struct anim_list_it **inactive_ctx;
+    struct anim_ctx **inactive_ctx;
 
     int running;
+    int step_mode;
+    struct timespec last_frame;
     float duration_coef;
     volatile int in_update_loop;
+    pthread_t update_thread;
     pthread_mutex_t mutex;
-};
 
-static struct anim_list_it EMPTY_CONTEXT;
+    struct anim_batch batches[INTERPOLATOR_CNT];
+    // filled under the mutex during the pass, read without it while the
+    // calls run, only the dropped flags change then
+    struct anim_call *calls;
+    int calls_cnt;
+    int calls_alloc;
+};
 
 static struct anim_list anim_list = {
     .first = NULL,
     .last = NULL,
     .inactive_ctx = NULL,
     .running = 0,
+    .step_mode = ANIM_STEP_WORKER,
     .duration_coef = 1.f,
     .in_update_loop = 0,
     .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .calls = NULL,
+    .calls_cnt = 0,
+    .calls_alloc = 0,
 };
 
+#define ANIM_INDEX_MIN_BUCKETS 64
+
+static inline uint32_t anim_index_hash_item(void *item, uint32_t bucket_cnt)
+{
+    uintptr_t h = ((uintptr_t)item) >> 3;
+    h ^= h >> 16;
+    return ((uint32_t)h * 2654435761U) & (bucket_cnt - 1);
+}
+
+static void anim_index_link(struct anim_index *idx, struct anim_list_it *it)
+{
+    struct anim_list_it **bucket;
+
+    bucket = &idx->id_buckets[it->anim->id & (idx->bucket_cnt - 1)];
+    it->id_prev = NULL;
+    it->id_next = *bucket;
+    if(*bucket)
+        (*bucket)->id_prev = it;
+    *bucket = it;
+
+    if(it->item)
+    {
+        bucket = &idx->item_buckets[anim_index_hash_item(it->item, idx->bucket_cnt)];
+        it->item_prev = NULL;
+        it->item_next = *bucket;
+        if(*bucket)
+            (*bucket)->item_prev = it;
+        *bucket = it;
+    }
+}
+
+static void anim_index_resize(struct anim_index *idx, uint32_t bucket_cnt, struct anim_list_it *first)
+{
+    struct anim_list_it *it;
+
+    free(idx->id_buckets);
+    free(idx->item_buckets);
+    idx->bucket_cnt = bucket_cnt;
+    idx->id_buckets = mzalloc(bucket_cnt*sizeof(struct anim_list_it*));
+    idx->item_buckets = mzalloc(bucket_cnt*sizeof(struct anim_list_it*));
+
+    for(it = first; it; it = it->next)
+        anim_index_link(idx, it);
+}
+
+// anim_list.mutex must be locked, it must already be in the list
+static void anim_index_add(struct anim_list_it *it)
+{
+    struct anim_index *idx = &anim_list.index;
+    anim_header *anim = it->anim;
+
+    it->item = NULL;
+    it->custom_check = 0;
+    if(anim->cancel_check == anim_item_cancel_check && anim->cancel_check_data)
+        it->item = anim->cancel_check_data;
+    else if(anim->cancel_check)
+    {
+        it->custom_check = 1;
+        ++idx->custom_checks;
+    }
+
+    ++idx->count;
+    if(idx->bucket_cnt == 0 || idx->count > idx->bucket_cnt*2)
+        anim_index_resize(idx, imax(ANIM_INDEX_MIN_BUCKETS, idx->bucket_cnt*2), anim_list.first);
+    else
+        anim_index_link(idx, it);
+}
+
+// anim_list.mutex must be locked
+static void anim_index_rm(struct anim_list_it *it)
+{
+    struct anim_index *idx = &anim_list.index;
+
+    if(it->id_prev)
+        it->id_prev->id_next = it->id_next;
+    else
+        idx->id_buckets[it->anim->id & (idx->bucket_cnt - 1)] = it->id_next;
+    if(it->id_next)
+        it->id_next->id_prev = it->id_prev;
+
+    if(it->item)
+    {
+        if(it->item_prev)
+            it->item_prev->item_next = it->item_next;
+        else
+            idx->item_buckets[anim_index_hash_item(it->item, idx->bucket_cnt)] = it->item_next;
+        if(it->item_next)
+            it->item_next->item_prev = it->item_prev;
+    }
+    else if(it->custom_check && idx->custom_checks != 0)
+        --idx->custom_checks;
+
+    --idx->count;
+}
+
+static void anim_index_free(struct anim_index *idx)
+{
+    free(idx->id_buckets);
+    free(idx->item_buckets);
+    memset(idx, 0, sizeof(struct anim_index));
+}
+
 static void anim_list_append(struct anim_list_it *it)
 {
     pthread_mutex_lock(&anim_list.mutex);
     if(!anim_list.first)
-    {
         anim_list.first = anim_list.last = it;
-        pthread_mutex_unlock(&anim_list.mutex);
-        return;
+    else
+    {
+        it->prev = anim_list.last;
+        anim_list.last->next = it;
+        anim_list.last = it;
     }
-
-    it->prev = anim_list.last;
-    anim_list.last->next = it;
-    anim_list.last = it;
+    anim_index_add(it);
     pthread_mutex_unlock(&anim_list.mutex);
 }
 
@@ -89,12 +256,37 @@ static void anim_list_rm(struct anim_list_it *it)
         it->next->prev = it->prev;
     else
         anim_list.last = it->prev;
+
+    anim_index_rm(it);
+}
+
+// anim_list.mutex must be locked
+static void anim_drop_calls(uint32_t id)
+{
+    int i;
+    for(i = 0; i < anim_list.calls_cnt; ++i)
+        if(anim_list.calls[i].id == id)
+            __atomic_store_n(&anim_list.calls[i].dropped, 1, __ATOMIC_RELEASE);
+}
+
+// anim_list.mutex must be locked
+static void anim_list_rm_free(struct anim_list_it *it)
+{
+    anim_drop_calls(it->anim->id);
+    anim_list_rm(it);
+    free(it->anim);
+    free(it);
 }
 
 // anim_list.mutex must be locked
 static void anim_list_clear(void)
 {
     struct anim_list_it *it, *next;
+    int i;
+
+    for(i = 0; i < anim_list.calls_cnt; ++i)
+        __atomic_store_n(&anim_list.calls[i].dropped, 1, __ATOMIC_RELEASE);
+
     for(next = anim_list.first; next; )
     {
         it = next;
@@ -104,28 +296,117 @@ static void anim_list_clear(void)
         free(it);
     }
     anim_list.first = anim_list.last = NULL;
+    anim_index_free(&anim_list.index);
 }
 
 #define OVERSHOOT_TENSION 2.f
-static float anim_interpolate(int type, float input)
+#define EASING_LUT_SIZE 256
+
+static float accel_decel_lut[EASING_LUT_SIZE+1];
+
+static void anim_init_luts(void)
+{
+    static int initialized = 0;
+    int i;
+
+    if(initialized)
+        return;
+
+    for(i = 0; i <= EASING_LUT_SIZE; ++i)
+        accel_decel_lut[i] = (float)(cos(((float)i/EASING_LUT_SIZE + 1) * M_PI) / 2.0f) + 0.5f;
+    initialized = 1;
+}
+
+static inline float anim_lut_lookup(const float *lut, float input)
+{
+    const float pos = input * EASING_LUT_SIZE;
+    const int idx = (int)pos;
+    if(idx >= EASING_LUT_SIZE)
+        return lut[EASING_LUT_SIZE];
+    return lut[idx] + (lut[idx+1] - lut[idx]) * (pos - idx);
+}
+
+// Evaluates one interpolator over the whole batch, the loops
+// are kept branch-free so that the compiler can vectorize them.
+static void anim_batch_interpolate(int type, const float *in, float *out, int cnt)
 {
+    int i;
+    float x;
+
     switch(type)
     {
         default:
         case INTERPOLATOR_LINEAR:
-            return input;
+            for(i = 0; i < cnt; ++i)
+                out[i] = in[i];
+            break;
         case INTERPOLATOR_DECELERATE:
-            return (1.f - (1.f - input) * (1.f - input));
+            for(i = 0; i < cnt; ++i)
+                out[i] = (1.f - (1.f - in[i]) * (1.f - in[i]));
+            break;
         case INTERPOLATOR_ACCELERATE:
-            return input * input;
+            for(i = 0; i < cnt; ++i)
+                out[i] = in[i] * in[i];
+            break;
         case INTERPOLATOR_OVERSHOOT:
-            input -= 1.f;
-            return (input * input * ((OVERSHOOT_TENSION+1.f) * input + OVERSHOOT_TENSION) + 1.f);
+            for(i = 0; i < cnt; ++i)
+            {
+                x = in[i] - 1.f;
+                out[i] = (x * x * ((OVERSHOOT_TENSION+1.f) * x + OVERSHOOT_TENSION) + 1.f);
+            }
+            break;
         case INTERPOLATOR_ACCEL_DECEL:
-            return (float)(cos((input + 1) * M_PI) / 2.0f) + 0.5f;
+            for(i = 0; i < cnt; ++i)
+                out[i] = anim_lut_lookup(accel_decel_lut, in[i]);
+            break;
     }
 }
 
+// anim_list.mutex must be locked
+static void anim_batch_add(struct anim_batch *b, struct anim_list_it *it, float normalized)
+{
+    if(b->count == b->alloc)
+    {
+        b->alloc = b->alloc ? b->alloc*2 : 16;
+        b->its = realloc(b->its, b->alloc*sizeof(struct anim_list_it*));
+        b->normalized = realloc(b->normalized, b->alloc*sizeof(float));
+        b->interpolated = realloc(b->interpolated, b->alloc*sizeof(float));
+    }
+
+    b->its[b->count] = it;
+    b->normalized[b->count] = normalized;
+    ++b->count;
+}
+
+static void anim_batch_free(struct anim_batch *b)
+{
+    free(b->its);
+    free(b->normalized);
+    free(b->interpolated);
+    memset(b, 0, sizeof(struct anim_batch));
+}
+
+// anim_list.mutex must be locked
+static void anim_queue_call(struct anim_list *list, uint32_t id, animation_callback_step step,
+        animation_callback call, void *data, float interpolated)
+{
+    struct anim_call *c;
+
+    if(list->calls_cnt == list->calls_alloc)
+    {
+        list->calls_alloc = list->calls_alloc ? list->calls_alloc*2 : 16;
+        list->calls = realloc(list->calls, list->calls_alloc*sizeof(struct anim_call));
+    }
+
+    c = &list->calls[list->calls_cnt++];
+    c->id = id;
+    c->dropped = 0;
+    c->step = step;
+    c->call = call;
+    c->data = data;
+    c->interpolated = interpolated;
+}
+
 static inline void anim_int_step(int *prop, int *start, int *last, int *target, float interpolated)
 {
     if(*target != -1)
@@ -176,33 +457,32 @@ static void item_anim_on_start(item_anim *anim)
         anim->targetH -= fb_it->h;
 }
 
-static void item_anim_on_finished(item_anim *anim)
-{
-    if(anim->destroy_item_when_finished)
-        fb_remove_item(anim->item);
-}
-
-static void call_anim_step(call_anim *anim, float interpolated)
-{
-    if(anim->callback)
-        anim->callback(anim->data, interpolated);
-}
-
 static int anim_update(uint32_t diff, void *data)
 {
     struct anim_list *list = data;
-    struct anim_list_it *it;
+    struct anim_list_it *it, *to_remove;
+    struct anim_batch *b;
+    struct anim_call *c;
     anim_header *anim;
-    float normalized, interpolated;
-    int need_draw = 0;
+    float normalized;
+    int i, need_draw = 0, has_finished = 0;
 
     pthread_mutex_lock(&list->mutex);
+    list->update_thread = pthread_self();
     list->in_update_loop = 1;
 
-    for(it = list->first; it; )
+    // Advance the clocks and sort running animations by interpolator
+    for(it = list->first; it; it = it->next)
     {
         anim = it->anim;
 
+        // left over from a context which was pushed while its callbacks ran
+        if(it->finished)
+        {
+            has_finished = 1;
+            continue;
+        }
+
         // Handle offset
         if(anim->start_offset)
         {
@@ -210,75 +490,145 @@ static int anim_update(uint32_t diff, void *data)
                 anim->start_offset -= diff;
             else
                 anim->start_offset = 0;
-            it = it->next;
             continue;
         }
 
-        // calculate interpolation
         anim->elapsed += diff;
         if(anim->elapsed >= anim->duration)
             normalized = 1.f;
         else
             normalized = ((float)anim->elapsed)/anim->duration;
 
-        interpolated = anim_interpolate(anim->interpolator, normalized);
+        i = anim->interpolator;
+        if(i < 0 || i >= INTERPOLATOR_CNT)
+            i = INTERPOLATOR_LINEAR;
+        anim_batch_add(&list->batches[i], it, normalized);
+        it->stepped = 1;
+    }
+
+    // calculate interpolation
+    for(i = 0; i < INTERPOLATOR_CNT; ++i)
+    {
+        b = &list->batches[i];
+        anim_batch_interpolate(i, b->normalized, b->interpolated, b->count);
+        while(b->count)
+        {
+            --b->count;
+            b->its[b->count]->interpolated = b->interpolated[b->count];
+        }
+    }
+
+    // Apply the steps in list order. Item and call_anim steps run under
+    // the lock like before, on_step and on_finished callbacks are queued.
+    for(it = list->first; it; it = it->next)
+    {
+        if(!it->stepped)
+            continue;
+
+        it->stepped = 0;
+        anim = it->anim;
 
-        // Handle animation step
         switch(it->anim_type)
         {
             case ANIM_TYPE_ITEM:
-                item_anim_step((item_anim*)anim, interpolated, &need_draw);
+                item_anim_step((item_anim*)anim, it->interpolated, &need_draw);
                 break;
             case ANIM_TYPE_CALLBACK:
-                call_anim_step((call_anim*)anim, interpolated);
+                if(((call_anim*)anim)->callback)
+                    ((call_anim*)anim)->callback(((call_anim*)anim)->data, it->interpolated);
                 break;
         }
 
         if(anim->on_step_call)
-        {
-            pthread_mutex_unlock(&list->mutex);
-            anim->on_step_call(anim->on_step_data, interpolated);
-            pthread_mutex_lock(&list->mutex);
-        }
+            anim_queue_call(list, anim->id, anim->on_step_call, NULL, anim->on_step_data, it->interpolated);
 
-        // remove complete animations
+        // complete animations stay in the list until their callbacks have run,
+        // so that cancelling them still drops the callbacks
         if(anim->elapsed >= anim->duration)
         {
             if(anim->on_finished_call)
-            {
-                pthread_mutex_unlock(&list->mutex);
-                anim->on_finished_call(anim->on_finished_data);
-                pthread_mutex_lock(&list->mutex);
-            }
+                anim_queue_call(list, anim->id, NULL, anim->on_finished_call, anim->on_finished_data, 1.f);
 
-            switch(it->anim_type)
-            {
-                case ANIM_TYPE_ITEM:
-                    pthread_mutex_unlock(&list->mutex);
-                    item_anim_on_finished((item_anim*)anim);
-                    pthread_mutex_lock(&list->mutex);
-                    break;
-            }
+            if(it->anim_type == ANIM_TYPE_ITEM && ((item_anim*)anim)->destroy_item_when_finished)
+                anim_queue_call(list, anim->id, NULL, &fb_remove_item, ((item_anim*)anim)->item, 1.f);
 
-            struct anim_list_it *to_remove = it;
-            it = it->next;
-            anim_list_rm(to_remove);
-            free(to_remove->anim);
-            free(to_remove);
+            it->finished = 1;
+            has_finished = 1;
         }
-        else
-            it = it->next;
     }
 
-    if(need_draw)
-        fb_request_draw();
+    // Callbacks might add or cancel animations, so they all run without
+    // the lock. Nothing queues calls until this tick is done, anim_cancel
+    // only marks calls of the cancelled animation as dropped and those
+    // are skipped. New animations start on the next tick.
+    if(list->calls_cnt != 0)
+    {
+        pthread_mutex_unlock(&list->mutex);
+        for(i = 0; i < list->calls_cnt; ++i)
+        {
+            c = &list->calls[i];
+            if(__atomic_load_n(&c->dropped, __ATOMIC_ACQUIRE))
+                continue;
+
+            if(c->step)
+                c->step(c->data, c->interpolated);
+            else
+                c->call(c->data);
+        }
+        pthread_mutex_lock(&list->mutex);
+        list->calls_cnt = 0;
+    }
+
+    // remove complete animations
+    for(it = has_finished ? list->first : NULL; it; )
+    {
+        to_remove = it;
+        it = it->next;
+        if(to_remove->finished)
+            anim_list_rm_free(to_remove);
+    }
 
     list->in_update_loop = 0;
     pthread_mutex_unlock(&list->mutex);
 
+    if(need_draw)
+        fb_request_draw();
+
     return 0;
 }
 
+static void anim_frame_step(const struct timespec *target, void *data)
+{
+    struct anim_list *list = data;
+    struct timespec t = *target;
+    uint32_t diff = 0;
+
+    if(list->last_frame.tv_sec != 0 || list->last_frame.tv_nsec != 0)
+        diff = timespec_diff(&list->last_frame, &t);
+    list->last_frame = t;
+
+    anim_update(diff, list);
+}
+
+static void anim_attach_stepper(void)
+{
+    if(anim_list.step_mode == ANIM_STEP_FRAME)
+    {
+        anim_list.last_frame.tv_sec = anim_list.last_frame.tv_nsec = 0;
+        fb_set_frame_callback(&anim_frame_step, &anim_list);
+    }
+    else
+        workers_add(&anim_update, &anim_list);
+}
+
+static void anim_detach_stepper(void)
+{
+    if(anim_list.step_mode == ANIM_STEP_FRAME)
+        fb_set_frame_callback(NULL, NULL);
+    else
+        workers_remove(&anim_update, &anim_list);
+}
+
 static uint32_t anim_generate_id(void)
 {
     static uint32_t id = 0;
@@ -293,17 +643,47 @@ void anim_init(float duration_coef)
     if(anim_list.running)
         return;
 
+    anim_init_luts();
+
     anim_list.running = 1;
     anim_list.duration_coef = duration_coef;
-    workers_add(&anim_update, &anim_list);
+    anim_attach_stepper();
+}
+
+void anim_set_step_mode(int mode)
+{
+    if(anim_list.step_mode == mode)
+        return;
+
+    if(anim_list.running)
+        anim_detach_stepper();
+
+    anim_list.step_mode = mode;
+
+    if(anim_list.running)
+        anim_attach_stepper();
 }
 
 void anim_stop(int wait_for_finished)
 {
+    int i;
+
     if(!anim_list.running)
         return;
 
     anim_list.running = 0;
+
+    // The framebuffer might get frozen and stop presenting frames,
+    // finish the remaining animations on the worker thread instead.
+    // fb_set_frame_callback waits for a running frame step, so the two
+    // never step the list at the same time.
+    if(anim_list.step_mode == ANIM_STEP_FRAME)
+    {
+        fb_set_frame_callback(NULL, NULL);
+        if(wait_for_finished)
+            workers_add(&anim_update, &anim_list);
+    }
+
     while(wait_for_finished)
     {
         pthread_mutex_lock(&anim_list.mutex);
@@ -320,6 +700,11 @@ void anim_stop(int wait_for_finished)
 
     pthread_mutex_lock(&anim_list.mutex);
     anim_list_clear();
+    for(i = 0; i < INTERPOLATOR_CNT; ++i)
+        anim_batch_free(&anim_list.batches[i]);
+    free(anim_list.calls);
+    anim_list.calls = NULL;
+    anim_list.calls_cnt = anim_list.calls_alloc = 0;
     pthread_mutex_unlock(&anim_list.mutex);
 }
 
@@ -331,17 +716,16 @@ void anim_cancel(uint32_t id, int only_not_started)
     struct anim_list_it *it;
 
     pthread_mutex_lock(&anim_list.mutex);
-    for(it = anim_list.first; it; )
+    if(anim_list.index.bucket_cnt != 0)
     {
-        if(it->anim->id == id && (!only_not_started || it->anim->start_offset == 0))
+        for(it = anim_list.index.id_buckets[id & (anim_list.index.bucket_cnt - 1)]; it; it = it->id_next)
         {
-            anim_list_rm(it);
-            free(it->anim);
-            free(it);
-            break;
+            if(it->anim->id == id && (!only_not_started || it->anim->start_offset == 0))
+            {
+                anim_list_rm_free(it);
+                break;
+            }
         }
-        else
-            it = it->next;
     }
     pthread_mutex_unlock(&anim_list.mutex);
 }
@@ -351,18 +735,34 @@ void anim_cancel_for(void *fb_item, int only_not_started)
     if(!anim_list.running)
         return;
 
-    if(anim_list.in_update_loop && pthread_equal(pthread_self(), workers_get_thread_id()))
+    if(anim_list.in_update_loop && pthread_equal(pthread_self(), anim_list.update_thread))
         return;
 
     struct anim_list_it *it, *to_remove;
     anim_header *anim;
 
     pthread_mutex_lock(&anim_list.mutex);
-    for(it = anim_list.first; it; )
+    if(anim_list.index.bucket_cnt == 0)
+    {
+        pthread_mutex_unlock(&anim_list.mutex);
+        return;
+    }
+
+    for(it = anim_list.index.item_buckets[anim_index_hash_item(fb_item, anim_list.index.bucket_cnt)]; it; )
+    {
+        to_remove = it;
+        it = it->item_next;
+
+        if(to_remove->item == fb_item && !(only_not_started && to_remove->anim->start_offset == 0))
+            anim_list_rm_free(to_remove);
+    }
+
+    // animations with their own cancel check have to be asked one by one
+    for(it = anim_list.first; it && anim_list.index.custom_checks != 0; )
     {
         anim = it->anim;
 
-        if(!anim->cancel_check || (only_not_started && anim->start_offset == 0))
+        if(!it->custom_check || (only_not_started && anim->start_offset == 0))
         {
             it = it->next;
             continue;
@@ -372,9 +772,7 @@ void anim_cancel_for(void *fb_item, int only_not_started)
         {
             to_remove = it;
             it = it->next;
-            anim_list_rm(to_remove);
-            free(to_remove->anim);
-            free(to_remove);
+            anim_list_rm_free(to_remove);
         }
         else
             it = it->next;
@@ -384,16 +782,15 @@ void anim_cancel_for(void *fb_item, int only_not_started)
 
 void anim_push_context(void)
 {
+    struct anim_ctx *ctx = mzalloc(sizeof(struct anim_ctx));
+
     pthread_mutex_lock(&anim_list.mutex);
-    if(anim_list.first)
-    {
-        list_add(&anim_list.inactive_ctx, anim_list.first);
-        anim_list.first = anim_list.last = NULL;
-    }
-    else
-    {
-        list_add(&anim_list.inactive_ctx, &EMPTY_CONTEXT);
-    }
+    ctx->first = anim_list.first;
+    ctx->last = anim_list.last;
+    ctx->index = anim_list.index;
+    anim_list.first = anim_list.last = NULL;
+    memset(&anim_list.index, 0, sizeof(struct anim_index));
+    list_add(&anim_list.inactive_ctx, ctx);
     pthread_mutex_unlock(&anim_list.mutex);
 }
 
@@ -406,19 +803,14 @@ void anim_pop_context(void)
         return;
     }
 
-    if(anim_list.first)
-        anim_list_clear();
+    anim_list_clear();
 
     const int idx = list_item_count(anim_list.inactive_ctx)-1;
-    struct anim_list_it *last_active_ctx = anim_list.inactive_ctx[idx];
-    if(last_active_ctx != &EMPTY_CONTEXT)
-    {
-        anim_list.first = last_active_ctx;
-        while(last_active_ctx->next)
-            last_active_ctx = last_active_ctx->next;
-        anim_list.last = last_active_ctx;
-    }
-    list_rm_at(&anim_list.inactive_ctx, idx, NULL);
+    struct anim_ctx *ctx = anim_list.inactive_ctx[idx];
+    anim_list.first = ctx->first;
+    anim_list.last = ctx->last;
+    anim_list.index = ctx->index;
+    list_rm_at(&anim_list.inactive_ctx, idx, &free);
     pthread_mutex_unlock(&anim_list.mutex);
 }
 
@@ -461,9 +853,11 @@ void item_anim_add(item_anim *anim)
 
 void item_anim_add_after(item_anim *anim)
 {
-    struct anim_list_it *it;
+    struct anim_list_it *it = NULL;
     pthread_mutex_lock(&anim_list.mutex);
-    for(it = anim_list.first; it; it = it->next)
+    if(anim_list.index.bucket_cnt != 0)
+        it = anim_list.index.item_buckets[anim_index_hash_item(anim->item, anim_list.index.bucket_cnt)];
+    for(; it; it = it->item_next)
     {
         if(it->anim_type == ANIM_TYPE_ITEM && ((item_anim*)it->anim)->item == anim->item)
         {
@@ -33,6 +33,12 @@ enum
     INTERPOLATOR_ACCEL_DECEL,
 };
 
+enum
+{
+    ANIM_STEP_WORKER, // step animations on the worker thread's tick
+    ANIM_STEP_FRAME,  // step animations once per presented frame, from the draw thread
+};
+
 typedef void (*animation_callback)(void*); // data
 typedef void (*animation_callback_step)(void*, float); // data, interpolated
 typedef int (*animation_cancel_check)(void*, void*); // data, item
@@ -82,6 +88,7 @@ typedef struct
 
 void anim_init(float duration_coef);
 void anim_stop(int wait_for_finished);
+void anim_set_step_mode(int mode);
 void anim_cancel(uint32_t id, int only_not_started);
 void anim_cancel_for(void *fb_item, int only_not_started);
 void anim_push_context(void);
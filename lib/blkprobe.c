@@ -0,0 +1,285 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "blkprobe.h"
+#include "containers.h"
+#include "util.h"
+#include "log.h"
+
+#define PROBE_THREADS 4
+
+// ext2/3/4 and f2fs keep the superblock at 1024, FAT, exFAT and NTFS
+// in the first sector, so these two reads cover all of them.
+#define BOOT_SECTOR_LEN 512
+#define SUPERBLOCK_OFF 1024
+#define SUPERBLOCK_LEN 256
+
+#define EXT_MAGIC 0xEF53
+#define EXT_MAGIC_OFF 0x38
+#define EXT_COMPAT_OFF 0x5C
+#define EXT_INCOMPAT_OFF 0x60
+#define EXT_RO_COMPAT_OFF 0x64
+#define EXT_UUID_OFF 0x68
+#define EXT3_COMPAT_HAS_JOURNAL 0x0004
+#define EXT4_RO_COMPAT_HUGE_FILE 0x0008
+#define EXT4_RO_COMPAT_DIR_NLINK 0x0020
+#define EXT4_INCOMPAT_EXTENTS 0x0040
+#define EXT4_INCOMPAT_64BIT 0x0080
+
+#define F2FS_MAGIC 0xF2F52010
+#define F2FS_UUID_OFF 0x6C
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void format_uuid_dce(char *uuid, const uint8_t *b)
+{
+    snprintf(uuid, BLKPROBE_UUID_LEN,
+            "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+            b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+}
+
+static void format_uuid_dos(char *uuid, const uint8_t *b)
+{
+    snprintf(uuid, BLKPROBE_UUID_LEN, "%02X%02X-%02X%02X", b[3], b[2], b[1], b[0]);
+}
+
+static int probe_superblock(const uint8_t *sb, char *type, char *uuid)
+{
+    if(get_le16(sb + EXT_MAGIC_OFF) == EXT_MAGIC)
+    {
+        uint32_t compat = get_le32(sb + EXT_COMPAT_OFF);
+        uint32_t incompat = get_le32(sb + EXT_INCOMPAT_OFF);
+        uint32_t ro_compat = get_le32(sb + EXT_RO_COMPAT_OFF);
+
+        if((ro_compat & (EXT4_RO_COMPAT_HUGE_FILE | EXT4_RO_COMPAT_DIR_NLINK)) ||
+            (incompat & (EXT4_INCOMPAT_EXTENTS | EXT4_INCOMPAT_64BIT)))
+            strcpy(type, "ext4");
+        else if(compat & EXT3_COMPAT_HAS_JOURNAL)
+            strcpy(type, "ext3");
+        else
+            strcpy(type, "ext2");
+
+        format_uuid_dce(uuid, sb + EXT_UUID_OFF);
+        return 0;
+    }
+
+    if(get_le32(sb) == F2FS_MAGIC)
+    {
+        strcpy(type, "f2fs");
+        format_uuid_dce(uuid, sb + F2FS_UUID_OFF);
+        return 0;
+    }
+    return -1;
+}
+
+static int probe_boot_sector(const uint8_t *bs, char *type, char *uuid)
+{
+    if(memcmp(bs + 3, "EXFAT   ", 8) == 0)
+    {
+        strcpy(type, "exfat");
+        format_uuid_dos(uuid, bs + 0x64);
+        return 0;
+    }
+
+    if(memcmp(bs + 3, "NTFS    ", 8) == 0)
+    {
+        const uint8_t *s = bs + 0x48;
+        strcpy(type, "ntfs");
+        snprintf(uuid, BLKPROBE_UUID_LEN, "%02X%02X%02X%02X%02X%02X%02X%02X",
+                s[7], s[6], s[5], s[4], s[3], s[2], s[1], s[0]);
+        return 0;
+    }
+
+    if(bs[510] != 0x55 || bs[511] != 0xAA)
+        return -1;
+
+    if(memcmp(bs + 0x52, "FAT32   ", 8) == 0)
+    {
+        strcpy(type, "vfat");
+        format_uuid_dos(uuid, bs + 0x43);
+        return 0;
+    }
+
+    if(memcmp(bs + 0x36, "FAT1", 4) == 0 || memcmp(bs + 0x36, "FAT     ", 8) == 0)
+    {
+        strcpy(type, "vfat");
+        format_uuid_dos(uuid, bs + 0x27);
+        return 0;
+    }
+    return -1;
+}
+
+int blkprobe_path(const char *path, char *type, char *uuid)
+{
+    uint8_t bs[BOOT_SECTOR_LEN];
+    uint8_t sb[SUPERBLOCK_LEN];
+    int res = -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    if(pread(fd, sb, sizeof(sb), SUPERBLOCK_OFF) == (ssize_t)sizeof(sb) &&
+        probe_superblock(sb, type, uuid) == 0)
+    {
+        res = 0;
+    }
+    else if(pread(fd, bs, sizeof(bs), 0) == (ssize_t)sizeof(bs) &&
+        probe_boot_sector(bs, type, uuid) == 0)
+    {
+        res = 0;
+    }
+
+    close(fd);
+    return res;
+}
+
+void blkprobe_dev_free(void *dev)
+{
+    struct blkprobe_dev *d = dev;
+    free(d->name);
+    free(d);
+}
+
+struct probe_ctx
+{
+    struct blkprobe_dev **devs;
+    char *found;
+    int next;
+    pthread_mutex_t mutex;
+};
+
+static void *probe_work(void *data)
+{
+    struct probe_ctx *ctx = data;
+    struct blkprobe_dev *dev;
+    char path[64];
+    int idx;
+
+    while(1)
+    {
+        pthread_mutex_lock(&ctx->mutex);
+        idx = ctx->next;
+        dev = ctx->devs[idx];
+        if(dev)
+            ++ctx->next;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if(!dev)
+            break;
+
+        snprintf(path, sizeof(path), "/dev/block/%s", dev->name);
+        ctx->found[idx] = (blkprobe_path(path, dev->type, dev->uuid) == 0);
+    }
+    return NULL;
+}
+
+static struct blkprobe_dev **read_partitions(int (*filter)(const char *name))
+{
+    struct blkprobe_dev **res = NULL;
+    struct blkprobe_dev *dev;
+    char line[256];
+    char name[64];
+    unsigned int major, minor;
+    unsigned long long blocks;
+
+    FILE *f = fopen("/proc/partitions", "re");
+    if(!f)
+    {
+        ERROR("Failed to open /proc/partitions: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, " %u %u %llu %63s", &major, &minor, &blocks, name) != 4)
+            continue;
+
+        if(filter && !filter(name))
+            continue;
+
+        dev = mzalloc(sizeof(struct blkprobe_dev));
+        dev->name = strdup(name);
+        list_add(&res, dev);
+    }
+
+    fclose(f);
+    return res;
+}
+
+struct blkprobe_dev **blkprobe_scan(int (*filter)(const char *name))
+{
+    pthread_t threads[PROBE_THREADS-1];
+    struct blkprobe_dev **res = NULL;
+    int i, started = 0;
+
+    struct probe_ctx ctx = {
+        .devs = read_partitions(filter),
+        .found = NULL,
+        .next = 0,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+
+    const int dev_cnt = list_item_count(ctx.devs);
+    if(dev_cnt == 0)
+        goto exit;
+
+    ctx.found = mzalloc(dev_cnt);
+
+    // Mostly waiting for (possibly slow USB) devices, so probe them in parallel
+    const int cnt = imin(dev_cnt, PROBE_THREADS) - 1;
+    for(i = 0; i < cnt; ++i)
+        if(pthread_create(&threads[started], NULL, probe_work, &ctx) == 0)
+            ++started;
+
+    probe_work(&ctx);
+
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    for(i = 0; i < dev_cnt; ++i)
+    {
+        if(ctx.found[i])
+            list_add(&res, ctx.devs[i]);
+        else
+            blkprobe_dev_free(ctx.devs[i]);
+    }
+
+exit:
+    list_clear(&ctx.devs, NULL);
+    free(ctx.found);
+    pthread_mutex_destroy(&ctx.mutex);
+    return res;
+}
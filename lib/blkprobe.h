@@ -0,0 +1,44 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLKPROBE_H
+#define BLKPROBE_H
+
+#include <stddef.h>
+
+#define BLKPROBE_TYPE_LEN 8
+#define BLKPROBE_UUID_LEN 40
+
+struct blkprobe_dev
+{
+    char *name;
+    char type[BLKPROBE_TYPE_LEN];
+    char uuid[BLKPROBE_UUID_LEN];
+};
+
+// Reads the superblock of device at path and fills type and uuid,
+// formatted the same way as busybox blkid does.
+// Knows ext2/3/4, f2fs, vfat, exfat and ntfs. Returns 0 on success.
+int blkprobe_path(const char *path, char *type, char *uuid);
+
+// Probes all devices from /proc/partitions for which filter (if not NULL)
+// returns non-zero. Devices are probed in parallel. Returns NULL-terminated
+// list of recognized devices, free it with list_clear(&res, blkprobe_dev_free).
+struct blkprobe_dev **blkprobe_scan(int (*filter)(const char *name));
+void blkprobe_dev_free(void *dev);
+
+#endif
@@ -53,7 +53,7 @@ void button_init_ui(button *b, const char *text, int size)
         b->rect = NULL;
     }
 
-    add_touch_handler(&button_touch_handler, b);
+    add_touch_handler_rect(&button_touch_handler, b, (fb_item_pos*)b);
 }
 
 void button_destroy(button *b)
@@ -0,0 +1,299 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "cpio.h"
+#include "log.h"
+
+#define CPIO_MAGIC "070701"
+#define CPIO_HDR_LEN 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+// Only entries with nlink > 1 are matched by inode number when extracting,
+// new entries just need to stay clear of the ones mkbootfs generates.
+#define CPIO_NEW_INO_BASE 0x40000000
+
+#define ALIGN4(x) (((x) + 3) & ~((size_t)3))
+
+static int parse_hex(const uint8_t *p, uint32_t *res)
+{
+    int i;
+    uint32_t val = 0;
+    for(i = 0; i < 8; ++i)
+    {
+        val <<= 4;
+        if(p[i] >= '0' && p[i] <= '9')
+            val |= p[i] - '0';
+        else if(p[i] >= 'a' && p[i] <= 'f')
+            val |= p[i] - 'a' + 10;
+        else if(p[i] >= 'A' && p[i] <= 'F')
+            val |= p[i] - 'A' + 10;
+        else
+            return -1;
+    }
+    *res = val;
+    return 0;
+}
+
+void cpio_reader_init(struct cpio_reader *r, const void *buf, size_t len)
+{
+    r->buf = buf;
+    r->len = len;
+    r->pos = 0;
+}
+
+int cpio_read_next(struct cpio_reader *r, struct cpio_entry *e)
+{
+    uint32_t fields[13];
+    const uint8_t *hdr;
+    size_t name_off, data_off;
+    int i;
+
+    if(r->pos + CPIO_HDR_LEN > r->len)
+        return -1;
+
+    hdr = r->buf + r->pos;
+    if(memcmp(hdr, CPIO_MAGIC, 6) != 0)
+        return -1;
+
+    for(i = 0; i < 13; ++i)
+        if(parse_hex(hdr + 6 + i*8, &fields[i]) < 0)
+            return -1;
+
+    // fields[11] is name size including the NUL, fields[12] the unused checksum
+    name_off = r->pos + CPIO_HDR_LEN;
+    if(fields[11] == 0 || name_off + fields[11] > r->len || r->buf[name_off + fields[11] - 1] != 0)
+        return -1;
+
+    data_off = ALIGN4(name_off + fields[11]);
+    if(data_off + fields[6] > r->len)
+        return -1;
+
+    e->ino = fields[0];
+    e->mode = fields[1];
+    e->uid = fields[2];
+    e->gid = fields[3];
+    e->nlink = fields[4];
+    e->mtime = fields[5];
+    e->size = fields[6];
+    e->devmajor = fields[7];
+    e->devminor = fields[8];
+    e->rdevmajor = fields[9];
+    e->rdevminor = fields[10];
+    e->name = (const char*)r->buf + name_off;
+    e->data = r->buf + data_off;
+
+    if(strcmp(e->name, CPIO_TRAILER) == 0)
+        return 0;
+
+    r->pos = ALIGN4(data_off + fields[6]);
+    return 1;
+}
+
+void cpio_writer_init(struct cpio_writer *w)
+{
+    w->buf = NULL;
+    w->len = 0;
+    w->alloc = 0;
+    w->next_ino = CPIO_NEW_INO_BASE;
+}
+
+void cpio_writer_destroy(struct cpio_writer *w)
+{
+    free(w->buf);
+    cpio_writer_init(w);
+}
+
+static int cpio_reserve(struct cpio_writer *w, size_t size)
+{
+    size_t alloc = w->alloc ? w->alloc : 64*1024;
+    uint8_t *buf;
+
+    while(alloc < w->len + size)
+        alloc *= 2;
+
+    if(alloc != w->alloc)
+    {
+        buf = realloc(w->buf, alloc);
+        if(!buf)
+        {
+            ERROR("cpio: failed to allocate %u bytes\n", (unsigned)alloc);
+            return -1;
+        }
+        w->buf = buf;
+        w->alloc = alloc;
+    }
+    return 0;
+}
+
+int cpio_write_entry(struct cpio_writer *w, const struct cpio_entry *e)
+{
+    const size_t name_size = strlen(e->name) + 1;
+    const size_t data_off = ALIGN4(CPIO_HDR_LEN + name_size);
+    const size_t total = ALIGN4(data_off + e->size);
+    char hdr[CPIO_HDR_LEN + 1];
+
+    if(cpio_reserve(w, total) < 0)
+        return -1;
+
+    snprintf(hdr, sizeof(hdr), CPIO_MAGIC "%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            e->ino, e->mode, e->uid, e->gid, e->nlink, e->mtime, e->size,
+            e->devmajor, e->devminor, e->rdevmajor, e->rdevminor, (uint32_t)name_size, 0);
+
+    memset(w->buf + w->len, 0, total);
+    memcpy(w->buf + w->len, hdr, CPIO_HDR_LEN);
+    memcpy(w->buf + w->len + CPIO_HDR_LEN, e->name, name_size);
+    if(e->size)
+        memcpy(w->buf + w->len + data_off, e->data, e->size);
+    w->len += total;
+    return 0;
+}
+
+int cpio_write_file(struct cpio_writer *w, const char *name, uint32_t mode, const void *data, uint32_t size)
+{
+    struct cpio_entry e;
+    memset(&e, 0, sizeof(e));
+    e.ino = w->next_ino++;
+    e.mode = mode;
+    e.nlink = (S_ISDIR(mode) ? 2 : 1);
+    e.mtime = time(NULL);
+    e.name = name;
+    e.data = data;
+    e.size = size;
+    return cpio_write_entry(w, &e);
+}
+
+int cpio_write_symlink(struct cpio_writer *w, const char *name, const char *target)
+{
+    return cpio_write_file(w, name, S_IFLNK | 0777, target, strlen(target));
+}
+
+static int cpio_write_dir(struct cpio_writer *w, const char *name, const char *path, uint32_t mode)
+{
+    int res = -1;
+    DIR *d;
+    struct dirent *dt;
+    char child_name[256];
+    char child_path[256];
+
+    if(cpio_write_file(w, name, mode, NULL, 0) < 0)
+        return -1;
+
+    d = opendir(path);
+    if(!d)
+    {
+        ERROR("cpio: failed to open dir %s\n", path);
+        return -1;
+    }
+
+    while((dt = readdir(d)))
+    {
+        if(strcmp(dt->d_name, ".") == 0 || strcmp(dt->d_name, "..") == 0)
+            continue;
+
+        snprintf(child_name, sizeof(child_name), "%s/%s", name, dt->d_name);
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, dt->d_name);
+        if(cpio_write_path(w, child_name, child_path, 0) < 0)
+            goto exit;
+    }
+    res = 0;
+exit:
+    closedir(d);
+    return res;
+}
+
+int cpio_write_path(struct cpio_writer *w, const char *name, const char *path, uint32_t mode)
+{
+    struct stat info;
+    char target[256];
+    uint8_t *data;
+    ssize_t len;
+    int fd, res;
+
+    if(lstat(path, &info) < 0)
+    {
+        ERROR("cpio: failed to stat %s\n", path);
+        return -1;
+    }
+
+    if(mode == 0)
+        mode = info.st_mode;
+
+    if(S_ISDIR(info.st_mode))
+        return cpio_write_dir(w, name, path, mode);
+
+    if(S_ISLNK(info.st_mode))
+    {
+        len = readlink(path, target, sizeof(target)-1);
+        if(len < 0)
+            return -1;
+        target[len] = 0;
+        return cpio_write_symlink(w, name, target);
+    }
+
+    if(!S_ISREG(info.st_mode))
+    {
+        ERROR("cpio: %s is not a regular file\n", path);
+        return -1;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        ERROR("cpio: failed to open %s\n", path);
+        return -1;
+    }
+
+    data = malloc(info.st_size ? info.st_size : 1);
+    if(!data)
+    {
+        ERROR("cpio: failed to allocate %u bytes\n", (unsigned)info.st_size);
+        close(fd);
+        return -1;
+    }
+
+    len = read(fd, data, info.st_size);
+    close(fd);
+
+    if(len != info.st_size)
+    {
+        ERROR("cpio: failed to read %s\n", path);
+        free(data);
+        return -1;
+    }
+
+    res = cpio_write_file(w, name, mode, data, info.st_size);
+    free(data);
+    return res;
+}
+
+int cpio_write_trailer(struct cpio_writer *w)
+{
+    struct cpio_entry e;
+    memset(&e, 0, sizeof(e));
+    e.nlink = 1;
+    e.name = CPIO_TRAILER;
+    return cpio_write_entry(w, &e);
+}
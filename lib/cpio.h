@@ -0,0 +1,72 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPIO_H
+#define CPIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// "newc" cpio archives, as used by Android ramdisks
+
+struct cpio_entry
+{
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint32_t mtime;
+    uint32_t devmajor;
+    uint32_t devminor;
+    uint32_t rdevmajor;
+    uint32_t rdevminor;
+    const char *name;
+    const uint8_t *data;
+    uint32_t size;
+};
+
+struct cpio_reader
+{
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+};
+
+struct cpio_writer
+{
+    uint8_t *buf;
+    size_t len;
+    size_t alloc;
+    uint32_t next_ino;
+};
+
+void cpio_reader_init(struct cpio_reader *r, const void *buf, size_t len);
+// Returns 1 if entry was read, 0 at the end of archive and -1 if it is malformed.
+// Entry's name and data point into the archive buffer.
+int cpio_read_next(struct cpio_reader *r, struct cpio_entry *e);
+
+void cpio_writer_init(struct cpio_writer *w);
+void cpio_writer_destroy(struct cpio_writer *w);
+int cpio_write_entry(struct cpio_writer *w, const struct cpio_entry *e);
+int cpio_write_file(struct cpio_writer *w, const char *name, uint32_t mode, const void *data, uint32_t size);
+int cpio_write_symlink(struct cpio_writer *w, const char *name, const char *target);
+// Adds file, symlink or whole directory from disk. Uses its mode if mode is 0.
+int cpio_write_path(struct cpio_writer *w, const char *name, const char *path, uint32_t mode);
+int cpio_write_trailer(struct cpio_writer *w);
+
+#endif
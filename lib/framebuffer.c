@@ -42,6 +42,9 @@
 #include "listview.h"
 #include "atomics.h"
 #include "mrom_data.h"
+#ifdef MR_INPUT_LATENCY
+#include "input_latency.h"
+#endif
 
 #if PIXEL_SIZE == 4
 #define fb_memset(dst, what, len) android_memset32(dst, what, len)
@@ -79,6 +82,11 @@ static pthread_cond_t fb_draw_cond = PTHREAD_COND_INITIALIZER;
 static atomic_int fb_draw_requested = ATOMIC_VAR_INIT(0);
 static volatile int fb_draw_run = 0;
 static void *fb_draw_thread_work(void*);
+static pthread_mutex_t fb_frame_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fb_frame_callback fb_frame_call = NULL;
+static void *fb_frame_data = NULL;
+static pthread_cond_t fb_frame_cond = PTHREAD_COND_INITIALIZER;
+static int fb_frame_busy = 0;
 
 static void fb_destroy_item(void *item); // private!
 static inline void fb_cpy_fb_with_rotation(px_type *dst, px_type *src);
@@ -202,6 +210,17 @@ void fb_close(void)
     fb_draw_run = 0;
     pthread_join(fb_draw_thread, NULL);
 
+#ifdef MR_INPUT_LATENCY
+    if(mrom_dir()[0] != 0)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/input_latency.txt", mrom_dir());
+        input_latency_dump(path);
+    }
+    else
+        input_latency_dump(NULL);
+#endif
+
     free(fb_rot_helpers);
     fb_rot_helpers = NULL;
 
@@ -279,6 +298,9 @@ void fb_update(void)
 {
     fb_cpy_fb_with_rotation(fb.impl->get_frame_dest(&fb), fb.buffer);
     fb.impl->update(&fb);
+#ifdef MR_INPUT_LATENCY
+    input_latency_frame_presented();
+#endif
 }
 
 void fb_cpy_fb_with_rotation(px_type *dst, px_type *src)
@@ -1075,11 +1097,46 @@ void fb_pop_context(void)
     fb_request_draw();
 }
 
+void fb_set_frame_callback(fb_frame_callback call, void *data)
+{
+    pthread_mutex_lock(&fb_frame_mutex);
+    fb_frame_call = call;
+    fb_frame_data = data;
+
+    // the old callback must not be running anymore once this returns,
+    // unless it is the one changing it
+    if(!pthread_equal(pthread_self(), fb_draw_thread))
+    {
+        while(fb_frame_busy)
+            pthread_cond_wait(&fb_frame_cond, &fb_frame_mutex);
+    }
+    pthread_mutex_unlock(&fb_frame_mutex);
+}
+
 #define SLEEP_CONST 16
+static void fb_next_frame_target(struct timespec *target, struct timespec *curr)
+{
+    int64_t t = (int64_t)target->tv_sec*1000000000LL + target->tv_nsec;
+    int64_t c = (int64_t)curr->tv_sec*1000000000LL + curr->tv_nsec;
+
+    // Keep the targets evenly spaced, unless the thread fell behind
+    // (or slept through frozen frames) by more than one frame.
+    t += SLEEP_CONST*1000000LL;
+    if(t - c > SLEEP_CONST*1000000LL || c - t > SLEEP_CONST*1000000LL)
+        *target = *curr;
+    else
+    {
+        target->tv_sec = t / 1000000000LL;
+        target->tv_nsec = t % 1000000000LL;
+    }
+}
+
 void *fb_draw_thread_work(UNUSED void *cookie)
 {
-    struct timespec last, curr;
+    struct timespec last, curr, target = { 0, 0 };
     uint32_t diff = 0, prevSleepTime = 0;
+    fb_frame_callback frame_call;
+    void *frame_data;
     clock_gettime(CLOCK_MONOTONIC, &last);
 
     atomic_int expected = ATOMIC_VAR_INIT(1);
@@ -1089,10 +1146,36 @@ void *fb_draw_thread_work(UNUSED void *cookie)
         clock_gettime(CLOCK_MONOTONIC, &curr);
         diff = timespec_diff(&last, &curr);
 
+        // frames which are never shown don't need to be prepared
+        if(!fb_frozen)
+        {
+            fb_next_frame_target(&target, &curr);
+
+            // called without the lock, so that it can change the callback
+            pthread_mutex_lock(&fb_frame_mutex);
+            frame_call = fb_frame_call;
+            frame_data = fb_frame_data;
+            fb_frame_busy = (frame_call != NULL);
+            pthread_mutex_unlock(&fb_frame_mutex);
+
+            if(frame_call)
+            {
+                frame_call(&target, frame_data);
+
+                pthread_mutex_lock(&fb_frame_mutex);
+                fb_frame_busy = 0;
+                pthread_cond_broadcast(&fb_frame_cond);
+                pthread_mutex_unlock(&fb_frame_mutex);
+            }
+        }
+
         expected.__val = 1; // might be reseted by atomic_compare_exchange_strong
         pthread_mutex_lock(&fb_draw_mutex);
         if(atomic_compare_exchange_strong(&fb_draw_requested, &expected, 0))
         {
+#ifdef MR_INPUT_LATENCY
+            input_latency_frame_start();
+#endif
             fb_draw();
             pthread_cond_broadcast(&fb_draw_cond);
             pthread_mutex_unlock(&fb_draw_mutex);
@@ -1125,6 +1208,9 @@ void fb_request_draw(void)
     if(!fb_frozen)
     {
         atomic_int expected = ATOMIC_VAR_INIT(0);
+#ifdef MR_INPUT_LATENCY
+        input_latency_draw_requested();
+#endif
         atomic_compare_exchange_strong(&fb_draw_requested, &expected, 1);
     }
 }
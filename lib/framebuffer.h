@@ -21,6 +21,7 @@
 #include <linux/fb.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <time.h>
 
 #if defined(RECOVERY_BGRA) || defined(RECOVERY_RGBX)
 #define PIXEL_SIZE 4
@@ -299,6 +300,13 @@ void fb_draw_line(fb_line *l);
 void fb_fill(uint32_t color);
 void fb_request_draw(void);
 void fb_force_draw(void);
+
+// Called from the draw thread once per frame, before it decides whether to draw.
+// The timestamp (CLOCK_MONOTONIC) is the frame's target presentation time.
+// Changing the callback waits until the previous one has returned, so it
+// must not be called with locks the callback takes.
+typedef void (*fb_frame_callback)(const struct timespec *, void *); // target, data
+void fb_set_frame_callback(fb_frame_callback call, void *data);
 void fb_clear(void);
 void fb_freeze(int freeze);
 int fb_clone(char **buff);
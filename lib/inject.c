@@ -20,8 +20,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "inject.h"
+#include "cpio.h"
+#include "lz4.h"
 #include "mrom_data.h"
 #include "log.h"
 #include "util.h"
@@ -35,200 +41,392 @@
 #error "libbootimg version 0.2.0 or higher is required. Please update libbootimg."
 #endif
 
-#define TMP_RD_UNPACKED_DIR "/mrom_rd"
+#define RD_GZIP 1
+#define RD_LZ4  2
 
-static int get_img_trampoline_ver(struct bootimg *img)
+int inject_get_trampoline_ver(struct boot_img_hdr *hdr)
 {
     int ver = 0;
-    if(strncmp((char*)img->hdr.name, "tr_ver", 6) == 0)
-        ver = atoi((char*)img->hdr.name + 6);
+    if(strncmp((char*)hdr->name, "tr_ver", 6) == 0)
+        ver = atoi((char*)hdr->name + 6);
     return ver;
 }
 
-static int copy_rd_files(UNUSED const char *path, UNUSED const char *busybox_path)
+static int rd_gunzip(const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len)
+{
+    int res = -1;
+    int z_res;
+    z_stream s;
+    size_t alloc = in_len*4;
+    uint8_t *buf = malloc(alloc), *tmp;
+
+    memset(&s, 0, sizeof(s));
+    if(!buf || inflateInit2(&s, 16 + MAX_WBITS) != Z_OK)
+    {
+        free(buf);
+        return -1;
+    }
+
+    s.next_in = (uint8_t*)in;
+    s.avail_in = in_len;
+    s.next_out = buf;
+    s.avail_out = alloc;
+
+    while((z_res = inflate(&s, Z_NO_FLUSH)) != Z_STREAM_END)
+    {
+        if(z_res != Z_OK && z_res != Z_BUF_ERROR)
+            goto exit;
+
+        if(s.avail_out == 0)
+        {
+            tmp = realloc(buf, alloc*2);
+            if(!tmp)
+                goto exit;
+            buf = tmp;
+            s.next_out = buf + alloc;
+            s.avail_out = alloc;
+            alloc *= 2;
+        }
+        else if(s.avail_in == 0)
+            goto exit; // truncated
+    }
+
+    *out = buf;
+    *out_len = s.total_out;
+    buf = NULL;
+    res = 0;
+exit:
+    inflateEnd(&s);
+    free(buf);
+    return res;
+}
+
+static int rd_gzip(const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len)
+{
+    int res = -1;
+    z_stream s;
+    uint8_t *buf = NULL;
+
+    memset(&s, 0, sizeof(s));
+    if(deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    const size_t alloc = deflateBound(&s, in_len) + 32;
+    buf = malloc(alloc);
+    if(!buf)
+        goto exit;
+
+    s.next_in = (uint8_t*)in;
+    s.avail_in = in_len;
+    s.next_out = buf;
+    s.avail_out = alloc;
+
+    if(deflate(&s, Z_FINISH) != Z_STREAM_END)
+        goto exit;
+
+    *out = buf;
+    *out_len = s.total_out;
+    buf = NULL;
+    res = 0;
+exit:
+    deflateEnd(&s);
+    free(buf);
+    return res;
+}
+
+static int rd_has_entry(const uint8_t *rd, size_t len, const char *name)
+{
+    struct cpio_reader r;
+    struct cpio_entry e;
+
+    cpio_reader_init(&r, rd, len);
+    while(cpio_read_next(&r, &e) > 0)
+        if(strcmp(e.name, name) == 0)
+            return 1;
+    return 0;
+}
+
+// Copies the archive while replacing /init with trampoline and
+// adding the other MultiROM files
+static int rd_update_files(const uint8_t *rd, size_t len, struct cpio_writer *w)
 {
     char buf[256];
+    int r, has_sbin = 0;
+    struct cpio_reader reader;
+    struct cpio_entry e;
+    const int has_main_init = rd_has_entry(rd, len, "main_init");
+#ifdef MR_USE_MROM_FSTAB
+    struct stat info;
+    snprintf(buf, sizeof(buf), "%s/mrom.fstab", mrom_dir());
+    const int replace_fstab = (stat(buf, &info) >= 0);
+#else
+    const int replace_fstab = 1;
+#endif
 
-    if (access(TMP_RD_UNPACKED_DIR"/main_init", F_OK) < 0 &&
-        rename(TMP_RD_UNPACKED_DIR"/init", TMP_RD_UNPACKED_DIR"/main_init") < 0)
+    cpio_reader_init(&reader, rd, len);
+    while((r = cpio_read_next(&reader, &e)) > 0)
+    {
+        if(strcmp(e.name, "init") == 0)
+        {
+            if(has_main_init)
+                continue;
+
+            e.name = "main_init";
+        }
+        else if(strcmp(e.name, "sbin/ueventd") == 0 || strcmp(e.name, "sbin/watchdogd") == 0 ||
+            (replace_fstab && strcmp(e.name, "mrom.fstab") == 0))
+        {
+            continue;
+        }
+#ifdef MR_ENCRYPTION
+        else if(strcmp(e.name, "mrom_enc") == 0 || strncmp(e.name, "mrom_enc/", 9) == 0)
+            continue;
+#endif
+        else if(strcmp(e.name, "sbin") == 0)
+            has_sbin = 1;
+
+        if(cpio_write_entry(w, &e) < 0)
+            return -1;
+    }
+
+    if(r < 0)
+    {
+        ERROR("Ramdisk cpio archive is corrupted!\n");
+        return -1;
+    }
+
+    if(!has_main_init && !rd_has_entry(rd, len, "init"))
     {
         ERROR("Failed to move /init to /main_init!\n");
         return -1;
     }
 
     snprintf(buf, sizeof(buf), "%s/trampoline", mrom_dir());
-    if(copy_file(buf, TMP_RD_UNPACKED_DIR"/init") < 0)
+    if(cpio_write_path(w, "init", buf, S_IFREG | 0750) < 0)
     {
         ERROR("Failed to copy trampoline to /init!\n");
         return -1;
     }
-    chmod(TMP_RD_UNPACKED_DIR"/init", 0750);
 
-    remove(TMP_RD_UNPACKED_DIR"/sbin/ueventd");
-    remove(TMP_RD_UNPACKED_DIR"/sbin/watchdogd");
-    symlink("../main_init", TMP_RD_UNPACKED_DIR"/sbin/ueventd");
-    symlink("../main_init", TMP_RD_UNPACKED_DIR"/sbin/watchdogd");
+    if(has_sbin)
+    {
+        cpio_write_symlink(w, "sbin/ueventd", "../main_init");
+        cpio_write_symlink(w, "sbin/watchdogd", "../main_init");
+    }
 
 #ifdef MR_USE_MROM_FSTAB
     snprintf(buf, sizeof(buf), "%s/mrom.fstab", mrom_dir());
-    copy_file(buf, TMP_RD_UNPACKED_DIR"/mrom.fstab");
-#else
-    remove(TMP_RD_UNPACKED_DIR"/mrom.fstab");
+    if(replace_fstab)
+        cpio_write_path(w, "mrom.fstab", buf, 0);
 #endif
 
 #ifdef MR_ENCRYPTION
-    remove_dir(TMP_RD_UNPACKED_DIR"/mrom_enc");
-
-    if(mr_system("busybox cp -a \"%s/enc\" \"%s/mrom_enc\"", mrom_dir(), TMP_RD_UNPACKED_DIR) != 0)
+    snprintf(buf, sizeof(buf), "%s/enc", mrom_dir());
+    if(cpio_write_path(w, "mrom_enc", buf, 0) < 0)
     {
         ERROR("Failed to copy encryption files!\n");
         return -1;
     }
 #endif
-    return 0;
+
+    return cpio_write_trailer(w);
 }
 
-#define RD_GZIP 1
-#define RD_LZ4  2
-static int inject_rd(const char *path)
+// Unpacks, updates and packs the ramdisk in memory, without any temporary files.
+static int inject_rd(struct bootimg *img)
 {
     int result = -1;
+    int type;
     uint32_t magic = 0;
+    uint8_t *rd = NULL, *packed = NULL;
+    size_t rd_len, packed_len;
+    struct cpio_writer w;
+    struct bootimg_blob *blob = &img->blobs[LIBBOOTIMG_BLOB_RAMDISK];
 
-    FILE *f = fopen(path, "re");
-    if(!f)
+    if(!blob->data || *blob->size < sizeof(magic))
     {
-        ERROR("Couldn't open %s!\n", path);
+        ERROR("Boot image has no ramdisk!\n");
         return -1;
     }
-    fread(&magic, sizeof(magic), 1, f);
-    fclose(f);
 
-    remove_dir(TMP_RD_UNPACKED_DIR);
-    mkdir(TMP_RD_UNPACKED_DIR, 0755);
+    memcpy(&magic, blob->data, sizeof(magic));
 
     // Decompress initrd
-    int type;
-    char buff[256];
-    char busybox_path[256];
-    snprintf(busybox_path, sizeof(busybox_path), "%s/busybox", mrom_dir());
-
-    char *cmd[] = { busybox_path, "sh", "-c", buff, NULL };
-
     if((magic & 0xFFFF) == 0x8B1F)
     {
         type = RD_GZIP;
-        snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" gzip -d -c \"%s\" | \"$B\" cpio -i", busybox_path, TMP_RD_UNPACKED_DIR, path);
+        if(rd_gunzip(blob->data, *blob->size, &rd, &rd_len) < 0)
+        {
+            ERROR("Failed to unpack gzip ramdisk!\n");
+            return -1;
+        }
     }
-    else if(magic == 0x184C2102)
+    else if(magic == LZ4_LEGACY_MAGIC)
     {
         type = RD_LZ4;
-        snprintf(buff, sizeof(buff), "cd \"%s\"; \"%s/lz4\" -d \"%s\" stdout | \"%s\" cpio -i", TMP_RD_UNPACKED_DIR, mrom_dir(), path, busybox_path);
+        if(lz4_legacy_decompress(blob->data, *blob->size, &rd, &rd_len) < 0)
+        {
+            ERROR("Failed to unpack lz4 ramdisk!\n");
+            return -1;
+        }
     }
     else
     {
         ERROR("Unknown ramdisk magic 0x%08X, can't update trampoline\n", magic);
-        goto success;
-    }
-
-    int r = run_cmd(cmd);
-    if(r != 0)
-    {
-        ERROR("Failed to unpack ramdisk! %s\n", buff);
-        goto fail;
+        return 0;
     }
 
     // Update files
-    if(copy_rd_files(path, busybox_path) < 0)
-        goto fail;
+    cpio_writer_init(&w);
+    if(rd_update_files(rd, rd_len, &w) < 0)
+        goto exit;
 
     // Pack initrd again
     switch(type)
     {
         case RD_GZIP:
-            snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" find . | \"$B\" cpio -o -H newc | \"$B\" gzip > \"%s\"", busybox_path, TMP_RD_UNPACKED_DIR, path);
+            if(rd_gzip(w.buf, w.len, &packed, &packed_len) < 0)
+                goto exit;
             break;
         case RD_LZ4:
-            snprintf(buff, sizeof(buff), "B=\"%s\"; cd \"%s\"; \"$B\" find . | \"$B\" cpio -o -H newc | \"%s/lz4\" stdin \"%s\"", busybox_path, TMP_RD_UNPACKED_DIR, mrom_dir(), path);
+            if(lz4_legacy_compress(w.buf, w.len, &packed, &packed_len) < 0)
+                goto exit;
             break;
     }
 
-    r = run_cmd(cmd);
-    if(r != 0)
-    {
-        ERROR("Failed to pack ramdisk!\n");
-        goto fail;
-    }
-
-success:
+    free(blob->data);
+    blob->data = packed;
+    *blob->size = packed_len;
     result = 0;
-fail:
-    remove_dir(TMP_RD_UNPACKED_DIR);
+exit:
+    if(result < 0)
+        ERROR("Failed to pack ramdisk!\n");
+    cpio_writer_destroy(&w);
+    free(rd);
     return result;
 }
 
-int inject_bootimg(const char *img_path, int force)
+// Moves tmp over path, so that path is either the old or the new image
+// even if the power goes out in the middle
+static int inject_replace_file(const char *tmp, const char *path)
 {
-    int res = -1;
-    struct bootimg img;
-    int img_ver;
-    char initrd_path[256];
-    static const char *initrd_tmp_name = "/inject-initrd.img";
+    struct stat info;
+    char dir[256];
+    char *sep;
+    int fd, res;
 
-    if(libbootimg_init_load(&img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
+    fd = open(tmp, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fsync(fd) < 0)
     {
-        ERROR("Could not open boot image (%s)!\n", img_path);
+        ERROR("Failed to sync %s (%d: %s)\n", tmp, errno, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        remove(tmp);
         return -1;
     }
 
-    img_ver = get_img_trampoline_ver(&img);
+    if(stat(path, &info) >= 0)
+        fchmod(fd, info.st_mode & 07777);
+    close(fd);
+
+    if(rename(tmp, path) < 0)
+    {
+        // tmp is next to path, but fuse-based storage might not support rename
+        ERROR("Failed to rename %s to %s (%d: %s), copying\n", tmp, path, errno, strerror(errno));
+        res = copy_file(tmp, path);
+        if(res < 0)
+            ERROR("Failed to copy %s to %s!\n", tmp, path);
+        remove(tmp);
+        return res;
+    }
+
+    // make the rename itself durable
+    snprintf(dir, sizeof(dir), "%s", path);
+    sep = strrchr(dir, '/');
+    if(sep)
+    {
+        *(sep == dir ? sep+1 : sep) = 0;
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd >= 0)
+        {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// Updates the trampoline in already loaded img, only in memory.
+// Returns 1 if img changed and should be written, 0 if it is up to date.
+int inject_bootimg_mem(struct bootimg *img, int force)
+{
+    int img_ver;
+
+    img_ver = inject_get_trampoline_ver(&img->hdr);
     if(!force && img_ver == VERSION_TRAMPOLINE)
     {
         INFO("No need to update trampoline.\n");
-        res = 0;
-        goto exit;
+        return 0;
     }
 
     INFO("Updating trampoline from ver %d to %d\n", img_ver, VERSION_TRAMPOLINE);
 
-    if(libbootimg_dump_ramdisk(&img, initrd_tmp_name) < 0)
-    {
-        ERROR("Failed to dump ramdisk to %s!\n", initrd_path);
-        goto exit;
-    }
+    if(inject_rd(img) < 0)
+        return -1;
 
-    if(inject_rd(initrd_tmp_name) >= 0)
-    {
-        // Update the boot.img
-        snprintf((char*)img.hdr.name, BOOT_NAME_SIZE, "tr_ver%d", VERSION_TRAMPOLINE);
+    snprintf((char*)img->hdr.name, BOOT_NAME_SIZE, "tr_ver%d", VERSION_TRAMPOLINE);
 #ifdef MR_RD_ADDR
-        img.hdr.ramdisk_addr = MR_RD_ADDR;
+    img->hdr.ramdisk_addr = MR_RD_ADDR;
 #endif
+    return 1;
+}
 
-        if(libbootimg_load_ramdisk(&img, initrd_tmp_name) < 0)
-        {
-            ERROR("Failed to load ramdisk from %s!\n", initrd_tmp_name);
-            goto exit;
-        }
+// Replaces img_path with img
+int inject_bootimg_write(struct bootimg *img, const char *img_path)
+{
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.new", img_path);
+    if(libbootimg_write_img(img, tmp) < 0)
+    {
+        ERROR("Failed to libbootimg_write_img!\n");
+        remove(tmp);
+        return -1;
+    }
 
-        char tmp[256];
-        strcpy(tmp, img_path);
-        strcat(tmp, ".new");
-        if(libbootimg_write_img(&img, tmp) >= 0)
-        {
-            INFO("Writing boot.img updated with trampoline v%d\n", VERSION_TRAMPOLINE);
-            if(copy_file(tmp, img_path) < 0)
-                ERROR("Failed to copy %s to %s!\n", tmp, img_path);
-            else
-                res = 0;
-            remove(tmp);
-        }
-        else
-            ERROR("Failed to libbootimg_write_img!\n");
+    INFO("Writing boot.img updated with trampoline v%d\n", VERSION_TRAMPOLINE);
+    return inject_replace_file(tmp, img_path);
+}
+
+// Updates the trampoline in already loaded img, both in memory and in img_path
+int inject_bootimg_img(struct bootimg *img, const char *img_path, int force)
+{
+    int res = inject_bootimg_mem(img, force);
+    if(res <= 0)
+        return res;
+    return inject_bootimg_write(img, img_path);
+}
+
+int inject_bootimg(const char *img_path, int force)
+{
+    int res;
+    struct bootimg img;
+    struct boot_img_hdr hdr;
+
+    // the version is in the header, no need to read the whole image
+    if(!force && libbootimg_load_header(&hdr, img_path) >= 0 &&
+        inject_get_trampoline_ver(&hdr) == VERSION_TRAMPOLINE)
+    {
+        INFO("No need to update trampoline.\n");
+        return 0;
     }
 
-exit:
+    if(libbootimg_init_load(&img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
+    {
+        ERROR("Could not open boot image (%s)!\n", img_path);
+        return -1;
+    }
+
+    res = inject_bootimg_img(&img, img_path, force);
     libbootimg_destroy(&img);
-    remove("/inject-initrd.img");
     return res;
 }
@@ -18,6 +18,13 @@
 #ifndef INJECT_H
 #define INJECT_H
 
+struct bootimg;
+struct boot_img_hdr;
+
 int inject_bootimg(const char *img_path, int force);
+int inject_bootimg_img(struct bootimg *img, const char *img_path, int force);
+int inject_bootimg_mem(struct bootimg *img, int force);
+int inject_bootimg_write(struct bootimg *img, const char *img_path);
+int inject_get_trampoline_ver(struct boot_img_hdr *hdr);
 
 #endif
@@ -20,8 +20,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/time.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <linux/kd.h>
 #include <pthread.h>
@@ -36,6 +40,9 @@
 #include "workers.h"
 #include "containers.h"
 #include "notification_card.h"
+#ifdef MR_INPUT_LATENCY
+#include "input_latency.h"
+#endif
 
 // for touch calculation
 int mt_screen_res[2] = { 0 };
@@ -45,8 +52,23 @@ int mt_switch_xy = 0;
 int mt_range_x[2] = { 0 };
 int mt_range_y[2] = { 0 };
 
-static struct pollfd ev_fds[MAX_DEVICES];
-static unsigned ev_count = 0;
+struct ev_device
+{
+    int fd;
+    char name[32];
+};
+
+// epoll ids of the non-device fds
+#define EV_ID_WAKE     (MAX_DEVICES)
+#define EV_ID_INOTIFY  (MAX_DEVICES+1)
+#define EV_READ_BATCH  64
+
+// changed only by the input thread, under ev_devs_mutex
+static struct ev_device ev_devs[MAX_DEVICES];
+static pthread_mutex_t ev_devs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int ev_epoll_fd = -1;
+static int ev_wake_fd = -1;
+static int ev_inotify_fd = -1;
 static volatile int input_run = 0;
 
 static int key_queue[10];
@@ -61,6 +83,46 @@ static pthread_cond_t input_start_cond = PTHREAD_COND_INITIALIZER;
 static handler_list_it *mt_handlers = NULL;
 static handlers_ctx **inactive_ctx = NULL;
 
+// handler changes which could not take touch_mutex right away
+static struct handler_op **handler_ops = NULL;
+static pthread_mutex_t handler_ops_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void touch_handlers_apply_ops(void);
+
+// Recorded input file: header followed by input_rec_event entries
+#define INPUT_REC_MAGIC "MRINPUT1"
+
+struct input_rec_header
+{
+    char magic[8];
+    int32_t range_x[2];
+    int32_t range_y[2];
+    int32_t switch_xy;
+};
+
+struct input_rec_event
+{
+    uint32_t us_offset; // since the first recorded event
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+static struct input_rec
+{
+    pthread_mutex_t mutex;
+    FILE *rec;
+    int64_t rec_start;
+    char *replay_path;
+    int replay_speed_pct;
+} input_rec = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .rec = NULL,
+    .rec_start = -1,
+    .replay_path = NULL,
+    .replay_speed_pct = 100,
+};
+
 #define DIV_ROUND_UP(n,d)  (((n) + (d) - 1) / (d))
 #define BIT(nr)            (1UL << (nr))
 #define BIT_MASK(nr)       (1UL << ((nr) % BITS_PER_LONG))
@@ -95,47 +157,116 @@ static void get_abs_min_max(int fd)
     }
 }
 
+static int ev_epoll_add(int fd, uint32_t id)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = id;
+    return epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void ev_open_device(int dir_fd, const char *name)
+{
+    int fd, i;
+    long absbit[BITS_TO_LONGS(ABS_CNT)];
+
+    if(strncmp(name, "event", 5) != 0)
+        return;
+
+    // IN_ATTRIB comes for devices which are open already, too
+    for(i = 0; i < MAX_DEVICES; ++i)
+        if(ev_devs[i].fd != -1 && strcmp(ev_devs[i].name, name) == 0)
+            return;
+
+    for(i = 0; i < MAX_DEVICES && ev_devs[i].fd != -1; ++i);
+    if(i == MAX_DEVICES)
+        return;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if(fd < 0)
+        return;
+
+    if(ev_epoll_add(fd, i) < 0)
+    {
+        ERROR("Failed to add %s to epoll: %s\n", name, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&ev_devs_mutex);
+    ev_devs[i].fd = fd;
+    snprintf(ev_devs[i].name, sizeof(ev_devs[i].name), "%s", name);
+    pthread_mutex_unlock(&ev_devs_mutex);
+
+    if (ioctl(fd, EVIOCGBIT(EV_ABS, ABS_CNT), absbit) >= 0)
+    {
+         if ((absbit[BIT_WORD(ABS_MT_POSITION_X)] & BIT_MASK(ABS_MT_POSITION_X)) &&
+            (absbit[BIT_WORD(ABS_MT_POSITION_Y)] & BIT_MASK(ABS_MT_POSITION_Y)))
+         {
+             get_abs_min_max(fd);
+         }
+    }
+}
+
+static void ev_close_device(int idx)
+{
+    if(ev_devs[idx].fd == -1)
+        return;
+
+    epoll_ctl(ev_epoll_fd, EPOLL_CTL_DEL, ev_devs[idx].fd, NULL);
+
+    pthread_mutex_lock(&ev_devs_mutex);
+    close(ev_devs[idx].fd);
+    ev_devs[idx].fd = -1;
+    ev_devs[idx].name[0] = 0;
+    pthread_mutex_unlock(&ev_devs_mutex);
+}
+
 static int ev_init(void)
 {
     DIR *dir;
     struct dirent *de;
-    int fd;
-    long absbit[BITS_TO_LONGS(ABS_CNT)];
+    int i;
+
+    pthread_mutex_lock(&ev_devs_mutex);
+    for(i = 0; i < MAX_DEVICES; ++i)
+        ev_devs[i].fd = -1;
+    pthread_mutex_unlock(&ev_devs_mutex);
 
-    ev_count = 0;
     mt_screen_res[0] = fb_get_vi_xres();
     mt_screen_res[1] = fb_get_vi_yres();
 
     init_touch_specifics();
 
-    dir = opendir("/dev/input");
-    if(!dir)
-        return -1;
-
-    while((de = readdir(dir)))
+    ev_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(ev_epoll_fd < 0)
     {
-        if(strncmp(de->d_name,"event",5))
-            continue;
-
-        fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_CLOEXEC);
-        if(fd < 0)
-            continue;
+        ERROR("Failed to create epoll fd: %s\n", strerror(errno));
+        return -1;
+    }
 
-        ev_fds[ev_count].fd = fd;
-        ev_fds[ev_count].events = POLLIN;
+    ev_epoll_add(ev_wake_fd, EV_ID_WAKE);
 
-        if (ioctl(fd, EVIOCGBIT(EV_ABS, ABS_CNT), absbit) >= 0)
+    // pick up hotplugged devices. ueventd might fix the permissions only
+    // after the node is created, so opening it is tried again on IN_ATTRIB.
+    ev_inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(ev_inotify_fd >= 0)
+    {
+        if(inotify_add_watch(ev_inotify_fd, "/dev/input", IN_CREATE | IN_ATTRIB | IN_DELETE) < 0 ||
+            ev_epoll_add(ev_inotify_fd, EV_ID_INOTIFY) < 0)
         {
-             if ((absbit[BIT_WORD(ABS_MT_POSITION_X)] & BIT_MASK(ABS_MT_POSITION_X)) &&
-                (absbit[BIT_WORD(ABS_MT_POSITION_Y)] & BIT_MASK(ABS_MT_POSITION_Y)))
-             {
-                 get_abs_min_max(fd);
-             }
+            close(ev_inotify_fd);
+            ev_inotify_fd = -1;
         }
-
-        ev_count++;
-        if(ev_count == MAX_DEVICES) break;
     }
+
+    dir = opendir("/dev/input");
+    if(!dir)
+        return -1;
+
+    while((de = readdir(dir)))
+        ev_open_device(dirfd(dir), de->d_name);
     closedir(dir);
 
     return 0;
@@ -143,32 +274,60 @@ static int ev_init(void)
 
 static void ev_exit(void)
 {
+    int i;
+
     destroy_touch_specifics();
 
-    while (ev_count > 0) {
-        close(ev_fds[--ev_count].fd);
+    for(i = 0; i < MAX_DEVICES; ++i)
+        ev_close_device(i);
+
+    if(ev_inotify_fd >= 0)
+    {
+        close(ev_inotify_fd);
+        ev_inotify_fd = -1;
+    }
+
+    if(ev_epoll_fd >= 0)
+    {
+        close(ev_epoll_fd);
+        ev_epoll_fd = -1;
     }
 }
 
-static int ev_get(struct input_event *ev, unsigned dont_wait)
+static void ev_handle_inotify(void)
 {
-    int r;
-    unsigned n;
+    char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *e;
+    int len, i, dir_fd;
+    char *p;
 
-    do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
+    len = read(ev_inotify_fd, buf, sizeof(buf));
+    if(len <= 0)
+        return;
 
-        if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) return 0;
-                }
-            }
+    dir_fd = open("/dev/input", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + e->len)
+    {
+        e = (struct inotify_event*)p;
+        if(e->len == 0)
+            continue;
+
+        if(e->mask & (IN_CREATE | IN_ATTRIB))
+        {
+            if(dir_fd >= 0)
+                ev_open_device(dir_fd, e->name);
+        }
+        else if(e->mask & IN_DELETE)
+        {
+            for(i = 0; i < MAX_DEVICES; ++i)
+                if(ev_devs[i].fd != -1 && strcmp(ev_devs[i].name, e->name) == 0)
+                    ev_close_device(i);
         }
-    } while(dont_wait == 0);
+    }
 
-    return -1;
+    if(dir_fd >= 0)
+        close(dir_fd);
 }
 
 #define IS_KEY_HANDLED(key) (key >= KEY_VOLUMEDOWN && key <= KEY_POWER)
@@ -246,9 +405,24 @@ static void mt_recalc_pos_rotation(touch_event *ev)
     }
 }
 
+// Handlers registered with bounds only see new touches which start
+// inside them, and afterwards only the touches they have consumed.
+// The bounds follow their fb item, which may move (e.g. tabview),
+// so they are tested on dispatch rather than kept in a spatial index.
+static inline int touch_handler_is_candidate(touch_handler *h, touch_event *ev)
+{
+    fb_item_pos *b = h->bounds;
+
+    if(!b || h->capture_id == ev->id)
+        return 1;
+
+    return (ev->changed & TCHNG_ADDED) && in_rect(ev->x, ev->y, b->x, b->y, b->w, b->h);
+}
+
 void touch_commit_events(struct timeval ev_time)
 {
     pthread_mutex_lock(&touch_mutex);
+    touch_handlers_apply_ops();
     int has_handlers = (mt_handlers != NULL);
     pthread_mutex_unlock(&touch_mutex);
 
@@ -260,6 +434,10 @@ void touch_commit_events(struct timeval ev_time)
     touch_handler *h;
     handler_list_it *it;
 
+#ifdef MR_INPUT_LATENCY
+    input_latency_begin(ev_time);
+#endif
+
     for(i = 0; i < ARRAY_SIZE(mt_events); ++i)
     {
         mt_events[i].us_diff = timeval_us_diff(ev_time, mt_events[i].time);
@@ -274,30 +452,249 @@ void touch_commit_events(struct timeval ev_time)
             mt_recalc_pos_rotation(&mt_events[i]);
 
         pthread_mutex_lock(&touch_mutex);
+        // changes made by the handlers of the previous slot
+        touch_handlers_apply_ops();
         it = mt_handlers;
         while(it)
         {
             h = it->handler;
+            it = it->next;
+
+            if(!touch_handler_is_candidate(h, &mt_events[i]))
+                continue;
 
             res = (*h->callback)(&mt_events[i], h->data);
+            if(h->bounds)
+            {
+                if(mt_events[i].changed & TCHNG_REMOVED)
+                {
+                    if(h->capture_id == mt_events[i].id)
+                        h->capture_id = -1;
+                }
+                else if(res == 0 && (mt_events[i].changed & TCHNG_ADDED))
+                    h->capture_id = mt_events[i].id;
+            }
+
             if(res == 0)
                 mt_events[i].consumed = 1;
             else if(res == 1)
                 break;
-
-            it = it->next;
         }
         pthread_mutex_unlock(&touch_mutex);
 
         mt_events[i].consumed = 0;
         mt_events[i].changed = 0;
     }
+
+#ifdef MR_INPUT_LATENCY
+    input_latency_end();
+#endif
+}
+
+static void ev_handle_event(struct input_event *ev)
+{
+    switch(ev->type)
+    {
+        case EV_KEY:
+            handle_key_event(ev);
+            break;
+        case EV_ABS:
+            handle_abs_event(ev);
+            break;
+        case EV_SYN:
+            handle_syn_event(ev);
+            break;
+    }
+}
+
+static void input_record_events(struct input_event *evs, int cnt)
+{
+    struct input_rec_header hdr;
+    struct input_rec_event rec;
+    int64_t t;
+    int i;
+
+    pthread_mutex_lock(&input_rec.mutex);
+    if(!input_rec.rec)
+        goto exit;
+
+    // the touchscreen ranges are known only once the devices are open
+    if(input_rec.rec_start == -1)
+    {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, INPUT_REC_MAGIC, sizeof(hdr.magic));
+        hdr.range_x[0] = mt_range_x[0];
+        hdr.range_x[1] = mt_range_x[1];
+        hdr.range_y[0] = mt_range_y[0];
+        hdr.range_y[1] = mt_range_y[1];
+        hdr.switch_xy = mt_switch_xy;
+        fwrite(&hdr, sizeof(hdr), 1, input_rec.rec);
+
+        input_rec.rec_start = ((int64_t)evs[0].time.tv_sec)*1000000 + evs[0].time.tv_usec;
+    }
+
+    for(i = 0; i < cnt; ++i)
+    {
+        t = ((int64_t)evs[i].time.tv_sec)*1000000 + evs[i].time.tv_usec - input_rec.rec_start;
+        rec.us_offset = t > 0 ? (uint32_t)t : 0;
+        rec.type = evs[i].type;
+        rec.code = evs[i].code;
+        rec.value = evs[i].value;
+        fwrite(&rec, sizeof(rec), 1, input_rec.rec);
+    }
+
+exit:
+    pthread_mutex_unlock(&input_rec.mutex);
+}
+
+static void ev_read_device(int idx)
+{
+    struct input_event evs[EV_READ_BATCH];
+    int r, i, cnt;
+
+    r = read(ev_devs[idx].fd, evs, sizeof(evs));
+    if(r < 0)
+    {
+        if(errno == ENODEV)
+            ev_close_device(idx);
+        return;
+    }
+
+    cnt = r / sizeof(struct input_event);
+    if(cnt > 0 && input_rec.rec)
+        input_record_events(evs, cnt);
+
+    for(i = 0; i < cnt; ++i)
+        ev_handle_event(&evs[i]);
+}
+
+// Feeds the recorded events to the handlers instead of the devices.
+// Event timestamps keep the recorded spacing, whatever the replay speed is,
+// so that velocity tracking behaves the same.
+static void input_replay_run(void)
+{
+    struct input_rec_header hdr;
+    struct input_rec_event rec;
+    struct input_event ev;
+    struct timespec start, now;
+    struct timeval base;
+    struct pollfd wake;
+    int64_t due, elapsed;
+    int i, saved_range[5];
+    FILE *f;
+
+    f = fopen(input_rec.replay_path, "re");
+    if(!f)
+    {
+        ERROR("Failed to open input replay %s: %s\n", input_rec.replay_path, strerror(errno));
+        return;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, INPUT_REC_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        ERROR("Invalid input replay file %s\n", input_rec.replay_path);
+        fclose(f);
+        return;
+    }
+
+    INFO("Replaying input from %s at %d%% speed\n", input_rec.replay_path, input_rec.replay_speed_pct);
+
+    saved_range[0] = mt_range_x[0];
+    saved_range[1] = mt_range_x[1];
+    saved_range[2] = mt_range_y[0];
+    saved_range[3] = mt_range_y[1];
+    saved_range[4] = mt_switch_xy;
+    mt_range_x[0] = hdr.range_x[0];
+    mt_range_x[1] = hdr.range_x[1];
+    mt_range_y[0] = hdr.range_y[0];
+    mt_range_y[1] = hdr.range_y[1];
+    mt_switch_xy = hdr.switch_xy;
+
+    wake.fd = ev_wake_fd;
+    wake.events = POLLIN;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    gettimeofday(&base, NULL);
+
+    while(input_run && fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        due = ((int64_t)rec.us_offset)*100 / input_rec.replay_speed_pct;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = ((int64_t)(now.tv_sec - start.tv_sec))*1000000 + (now.tv_nsec - start.tv_nsec)/1000;
+        if(due > elapsed && poll(&wake, 1, (due - elapsed + 999)/1000) > 0)
+            break; // stop_input_thread
+
+        memset(&ev, 0, sizeof(ev));
+        ev.time.tv_sec = base.tv_sec + (base.tv_usec + rec.us_offset) / 1000000;
+        ev.time.tv_usec = (base.tv_usec + rec.us_offset) % 1000000;
+        ev.type = rec.type;
+        ev.code = rec.code;
+        ev.value = rec.value;
+        ev_handle_event(&ev);
+    }
+
+    fclose(f);
+    INFO("Input replay finished\n");
+
+    mt_range_x[0] = saved_range[0];
+    mt_range_x[1] = saved_range[1];
+    mt_range_y[0] = saved_range[2];
+    mt_range_y[1] = saved_range[3];
+    mt_switch_xy = saved_range[4];
+
+    // drop whatever the real devices produced during the replay
+    for(i = 0; i < MAX_DEVICES; ++i)
+    {
+        if(ev_devs[i].fd == -1)
+            continue;
+        while(read(ev_devs[i].fd, &ev, sizeof(ev)) > 0);
+    }
+}
+
+int input_record_start(const char *path)
+{
+    FILE *f = fopen(path, "we");
+    if(!f)
+    {
+        ERROR("Failed to open %s for input recording: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&input_rec.mutex);
+    if(input_rec.rec)
+        fclose(input_rec.rec);
+    input_rec.rec = f;
+    input_rec.rec_start = -1;
+    pthread_mutex_unlock(&input_rec.mutex);
+    return 0;
+}
+
+void input_record_stop(void)
+{
+    pthread_mutex_lock(&input_rec.mutex);
+    if(input_rec.rec)
+    {
+        fclose(input_rec.rec);
+        input_rec.rec = NULL;
+    }
+    pthread_mutex_unlock(&input_rec.mutex);
+}
+
+void input_set_replay(const char *path, int speed_pct)
+{
+    free(input_rec.replay_path);
+    input_rec.replay_path = path ? strdup(path) : NULL;
+    input_rec.replay_speed_pct = speed_pct > 0 ? speed_pct : 100;
 }
 
 static void *input_thread_work(UNUSED void *cookie)
 {
+    struct epoll_event events[MAX_DEVICES+2];
+    uint64_t wake_val;
+    int i, cnt;
+
     ev_init();
-    struct input_event ev;
 
     memset(mt_events, 0, sizeof(mt_events));
 
@@ -308,25 +705,39 @@ static void *input_thread_work(UNUSED void *cookie)
     pthread_cond_broadcast(&input_start_cond);
     pthread_mutex_unlock(&input_start_mutex);
 
-    int res;
-    while(input_run)
+    if(input_rec.replay_path)
     {
-        while(ev_get(&ev, 1) == 0)
+        input_replay_run();
+        input_set_replay(NULL, 0);
+    }
+
+    while(input_run && ev_epoll_fd >= 0)
+    {
+        cnt = epoll_wait(ev_epoll_fd, events, ARRAY_SIZE(events), -1);
+        if(cnt < 0)
         {
-            switch(ev.type)
+            if(errno == EINTR)
+                continue;
+            ERROR("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for(i = 0; i < cnt; ++i)
+        {
+            switch(events[i].data.u32)
             {
-                case EV_KEY:
-                    handle_key_event(&ev);
+                case EV_ID_WAKE:
+                    read(ev_wake_fd, &wake_val, sizeof(wake_val));
                     break;
-                case EV_ABS:
-                    handle_abs_event(&ev);
+                case EV_ID_INOTIFY:
+                    ev_handle_inotify();
                     break;
-                case EV_SYN:
-                    handle_syn_event(&ev);
+                default:
+                    if(ev_devs[events[i].data.u32].fd != -1)
+                        ev_read_device(events[i].data.u32);
                     break;
             }
         }
-        usleep(10000);
     }
     ev_exit();
     return NULL;
@@ -357,14 +768,21 @@ int is_any_key_pressed(void)
 {
     size_t n, i;
     unsigned long keys[BITS_TO_LONGS(KEY_CNT)];
-    for(n = 0; n < ev_count; ++n)
+    int res = 0;
+    if(!input_run)
+        return 0;
+
+    // the input thread might be closing the devices
+    pthread_mutex_lock(&ev_devs_mutex);
+    for(n = 0; n < MAX_DEVICES && !res; ++n)
     {
-        if(ioctl(ev_fds[n].fd, EVIOCGKEY(KEY_CNT), keys) >= 0)
-            for(i = 0; i < BITS_TO_LONGS(KEY_CNT); ++i)
+        if(ev_devs[n].fd != -1 && ioctl(ev_devs[n].fd, EVIOCGKEY(KEY_CNT), keys) >= 0)
+            for(i = 0; i < BITS_TO_LONGS(KEY_CNT) && !res; ++i)
                 if(keys[i] != 0)
-                    return 1;
+                    res = 1;
     }
-    return 0;
+    pthread_mutex_unlock(&ev_devs_mutex);
+    return res;
 }
 
 void start_input_thread(void)
@@ -381,6 +799,16 @@ void start_input_thread_wait(int wait_for_start)
         return;
     }
 
+    // created here so that stop_input_thread can wake the thread
+    // even if it did not get to ev_init yet
+    ev_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(ev_wake_fd < 0)
+    {
+        ERROR("Failed to create input wake fd: %s\n", strerror(errno));
+        pthread_mutex_unlock(&input_start_mutex);
+        return;
+    }
+
     input_run = 1;
     pthread_create(&input_thread, NULL, input_thread_work, NULL);
     if(wait_for_start)
@@ -397,36 +825,42 @@ void stop_input_thread(void)
         return;
     }
 
+    uint64_t wake_val = 1;
+
     input_run = 0;
+    write(ev_wake_fd, &wake_val, sizeof(wake_val));
     pthread_join(input_thread, NULL);
+
+    input_record_stop();
+
+    close(ev_wake_fd);
+    ev_wake_fd = -1;
     pthread_mutex_unlock(&input_start_mutex);
 }
 
 
-static void add_touch_handler_priv(touch_callback callback, void *data)
+// touch_mutex must be locked
+static void add_touch_handler_priv(touch_callback callback, void *data, fb_item_pos *bounds)
 {
     touch_handler *handler = mzalloc(sizeof(touch_handler));
     handler->data = data;
     handler->callback = callback;
+    handler->bounds = bounds;
+    handler->capture_id = -1;
 
     handler_list_it *new_it = mzalloc(sizeof(handler_list_it));
     new_it->handler = handler;
 
-    pthread_mutex_lock(&touch_mutex);
-
     handler_list_it *it = mt_handlers;
     if(mt_handlers)
         it->prev = new_it;
     new_it->next = it;
     mt_handlers = new_it;
-
-    pthread_mutex_unlock(&touch_mutex);
 }
 
-static void rm_touch_handler_priv(touch_callback callback, void *data)
+// touch_mutex must be locked
+static void rm_touch_handler_priv(touch_callback callback, void *data, UNUSED fb_item_pos *bounds)
 {
-    pthread_mutex_lock(&touch_mutex);
-
     handler_list_it *it = mt_handlers;
     while(it)
     {
@@ -448,60 +882,83 @@ static void rm_touch_handler_priv(touch_callback callback, void *data)
         free(it);
         break;
     }
-
-    pthread_mutex_unlock(&touch_mutex);
 }
 
-typedef void (*handler_call)(touch_callback, void*);
-struct handler_thread_data
+typedef void (*handler_call)(touch_callback, void*, fb_item_pos*);
+struct handler_op
 {
     handler_call handler;
     touch_callback callback;
     void *data;
+    fb_item_pos *bounds;
 };
 
-static void *touch_handler_thread_work(void *data)
+// touch_mutex must be locked
+static void touch_handlers_apply_ops(void)
 {
-    struct handler_thread_data *d = data;
-    d->handler(d->callback, d->data);
-    free(d);
-    return NULL;
+    struct handler_op **ops = NULL;
+    struct handler_op **itr;
+
+    pthread_mutex_lock(&handler_ops_mutex);
+    list_swap(&handler_ops, &ops);
+    pthread_mutex_unlock(&handler_ops_mutex);
+
+    if(!ops)
+        return;
+
+    for(itr = ops; *itr; ++itr)
+        (*itr)->handler((*itr)->callback, (*itr)->data, (*itr)->bounds);
+    list_clear(&ops, &free);
 }
 
-static void touch_handler_thread_dispatcher(int force_async, handler_call h_c, touch_callback callback, void *data)
+static void touch_handler_dispatcher(int force_async, handler_call h_c, touch_callback callback, void *data, fb_item_pos *bounds)
 {
-    if(force_async || pthread_self() == input_thread)
+    // The input thread holds touch_mutex while it runs the handlers,
+    // so the change is queued and applied before the next dispatch.
+    if(force_async || pthread_equal(pthread_self(), input_thread))
     {
-        struct handler_thread_data *d = mzalloc(sizeof(struct handler_thread_data));
-        d->handler = h_c;
-        d->callback = callback;
-        d->data = data;
-
-        pthread_t handler_thread;
-        pthread_create(&handler_thread, NULL, touch_handler_thread_work, d);
+        struct handler_op *op = mzalloc(sizeof(struct handler_op));
+        op->handler = h_c;
+        op->callback = callback;
+        op->data = data;
+        op->bounds = bounds;
+
+        pthread_mutex_lock(&handler_ops_mutex);
+        list_add(&handler_ops, op);
+        pthread_mutex_unlock(&handler_ops_mutex);
     }
     else
-        h_c(callback, data);
+    {
+        pthread_mutex_lock(&touch_mutex);
+        touch_handlers_apply_ops();
+        h_c(callback, data, bounds);
+        pthread_mutex_unlock(&touch_mutex);
+    }
 }
 
 void add_touch_handler(touch_callback callback, void *data)
 {
-   touch_handler_thread_dispatcher(0, add_touch_handler_priv, callback, data);
+   touch_handler_dispatcher(0, add_touch_handler_priv, callback, data, NULL);
+}
+
+void add_touch_handler_rect(touch_callback callback, void *data, fb_item_pos *bounds)
+{
+   touch_handler_dispatcher(0, add_touch_handler_priv, callback, data, bounds);
 }
 
 void rm_touch_handler(touch_callback callback, void *data)
 {
-    touch_handler_thread_dispatcher(0, rm_touch_handler_priv, callback, data);
+    touch_handler_dispatcher(0, rm_touch_handler_priv, callback, data, NULL);
 }
 
 void add_touch_handler_async(touch_callback callback, void *data)
 {
-   touch_handler_thread_dispatcher(1, add_touch_handler_priv, callback, data);
+   touch_handler_dispatcher(1, add_touch_handler_priv, callback, data, NULL);
 }
 
 void rm_touch_handler_async(touch_callback callback, void *data)
 {
-    touch_handler_thread_dispatcher(1, rm_touch_handler_priv, callback, data);
+    touch_handler_dispatcher(1, rm_touch_handler_priv, callback, data, NULL);
 }
 
 void input_push_context(void)
@@ -509,6 +966,7 @@ void input_push_context(void)
     handlers_ctx *ctx = mzalloc(sizeof(handlers_ctx));
 
     pthread_mutex_lock(&touch_mutex);
+    touch_handlers_apply_ops();
     ctx->handlers = mt_handlers;
     mt_handlers = NULL;
     pthread_mutex_unlock(&touch_mutex);
@@ -525,6 +983,7 @@ void input_pop_context(void)
     handlers_ctx *ctx = inactive_ctx[idx];
 
     pthread_mutex_lock(&touch_mutex);
+    touch_handlers_apply_ops();
     mt_handlers = ctx->handlers;
     pthread_mutex_unlock(&touch_mutex);
 
@@ -51,11 +51,20 @@ void start_input_thread(void);
 void start_input_thread_wait(int wait_for_start);
 void stop_input_thread(void);
 
+// Records the raw events read from /dev/input into path
+int input_record_start(const char *path);
+void input_record_stop(void);
+// The next input thread replays the recording from path before it starts
+// reading /dev/input. speed_pct is the replay speed, 100 is as recorded.
+void input_set_replay(const char *path, int speed_pct);
+
 int get_last_key(void);
 int wait_for_key(void);
 int is_any_key_pressed(void);
 
 void add_touch_handler(touch_callback callback, void *data);
+// the handler only gets touches which started inside bounds and those it has consumed
+void add_touch_handler_rect(touch_callback callback, void *data, fb_item_pos *bounds);
 void rm_touch_handler(touch_callback callback, void *data);
 void add_touch_handler_async(touch_callback callback, void *data);
 void rm_touch_handler_async(touch_callback callback, void *data);
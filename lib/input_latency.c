@@ -0,0 +1,183 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "input_latency.h"
+#include "log.h"
+
+#define SAMPLES_MAX 1024
+#define BUCKET_MS 4
+#define BUCKET_CNT 25 // the last one collects everything above
+
+static struct input_latency
+{
+    pthread_mutex_t mutex;
+
+    // set by the input thread while it runs the touch handlers
+    volatile int dispatching;
+    pthread_t dispatch_thread;
+    int64_t dispatch_tag;
+
+    int64_t draw_tag;  // oldest input waiting for a frame
+    int64_t frame_tag; // input shown by the frame being drawn, draw thread only
+
+    uint32_t samples[SAMPLES_MAX]; // in us
+    uint32_t samples_cnt;
+    uint32_t samples_itr;
+} lat = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .dispatching = 0,
+    .draw_tag = 0,
+    .frame_tag = 0,
+    .samples_cnt = 0,
+    .samples_itr = 0,
+};
+
+static inline int64_t timeval_to_us(struct timeval *tv)
+{
+    return ((int64_t)tv->tv_sec)*1000000 + tv->tv_usec;
+}
+
+void input_latency_begin(struct timeval ev_time)
+{
+    lat.dispatch_tag = timeval_to_us(&ev_time);
+    lat.dispatch_thread = pthread_self();
+    lat.dispatching = 1;
+}
+
+void input_latency_end(void)
+{
+    lat.dispatching = 0;
+}
+
+void input_latency_draw_requested(void)
+{
+    if(!lat.dispatching || !pthread_equal(pthread_self(), lat.dispatch_thread))
+        return;
+
+    pthread_mutex_lock(&lat.mutex);
+    if(lat.draw_tag == 0)
+        lat.draw_tag = lat.dispatch_tag;
+    pthread_mutex_unlock(&lat.mutex);
+}
+
+void input_latency_frame_start(void)
+{
+    pthread_mutex_lock(&lat.mutex);
+    lat.frame_tag = lat.draw_tag;
+    lat.draw_tag = 0;
+    pthread_mutex_unlock(&lat.mutex);
+}
+
+void input_latency_frame_presented(void)
+{
+    struct timeval now;
+    int64_t diff;
+
+    if(lat.frame_tag == 0)
+        return;
+
+    // input_event timestamps use the realtime clock
+    gettimeofday(&now, NULL);
+    diff = timeval_to_us(&now) - lat.frame_tag;
+    lat.frame_tag = 0;
+
+    if(diff < 0)
+        return;
+
+    pthread_mutex_lock(&lat.mutex);
+    lat.samples[lat.samples_itr] = diff > UINT32_MAX ? UINT32_MAX : (uint32_t)diff;
+    lat.samples_itr = (lat.samples_itr + 1) % SAMPLES_MAX;
+    if(lat.samples_cnt < SAMPLES_MAX)
+        ++lat.samples_cnt;
+    pthread_mutex_unlock(&lat.mutex);
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    const uint32_t sa = *((const uint32_t*)a);
+    const uint32_t sb = *((const uint32_t*)b);
+    return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+void input_latency_dump(const char *path)
+{
+    uint32_t samples[SAMPLES_MAX];
+    uint32_t buckets[BUCKET_CNT] = { 0 };
+    uint32_t i, cnt, b;
+    uint64_t sum = 0;
+    FILE *f = NULL;
+
+    pthread_mutex_lock(&lat.mutex);
+    cnt = lat.samples_cnt;
+    memcpy(samples, lat.samples, cnt*sizeof(uint32_t));
+    pthread_mutex_unlock(&lat.mutex);
+
+    if(cnt == 0)
+    {
+        INFO("Input latency: no samples\n");
+        return;
+    }
+
+    qsort(samples, cnt, sizeof(uint32_t), compare_samples);
+    for(i = 0; i < cnt; ++i)
+    {
+        sum += samples[i];
+        b = samples[i] / (BUCKET_MS*1000);
+        ++buckets[b < BUCKET_CNT ? b : BUCKET_CNT-1];
+    }
+
+    INFO("Input latency (%u samples, us): min %u avg %u p50 %u p90 %u p99 %u max %u\n",
+            cnt, samples[0], (uint32_t)(sum/cnt), samples[cnt/2], samples[(cnt*9)/10],
+            samples[(cnt*99)/100], samples[cnt-1]);
+
+    if(path)
+    {
+        f = fopen(path, "we");
+        if(!f)
+            ERROR("Failed to open %s for input latency dump\n", path);
+        else
+        {
+            fprintf(f, "samples=%u\nmin_us=%u\navg_us=%u\np50_us=%u\np90_us=%u\np99_us=%u\nmax_us=%u\n",
+                    cnt, samples[0], (uint32_t)(sum/cnt), samples[cnt/2], samples[(cnt*9)/10],
+                    samples[(cnt*99)/100], samples[cnt-1]);
+        }
+    }
+
+    for(i = 0; i < BUCKET_CNT; ++i)
+    {
+        if(buckets[i] == 0)
+            continue;
+
+        if(i == BUCKET_CNT-1)
+            INFO("  >= %3u ms: %u\n", i*BUCKET_MS, buckets[i]);
+        else
+            INFO("  %3u-%3u ms: %u\n", i*BUCKET_MS, (i+1)*BUCKET_MS, buckets[i]);
+
+        if(f)
+            fprintf(f, "bucket_%u_ms=%u\n", i*BUCKET_MS, buckets[i]);
+    }
+
+    if(f)
+        fclose(f);
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INPUT_LATENCY_H
+#define INPUT_LATENCY_H
+
+#include <sys/time.h>
+
+// Input-to-photon latency: the time from the kernel's input_event timestamp
+// to the end of impl->update of the first frame drawn because of that input.
+// Only built with MR_INPUT_LATENCY.
+
+// input thread, around the dispatch of one touch batch
+void input_latency_begin(struct timeval ev_time);
+void input_latency_end(void);
+
+// fb_request_draw, tags the next frame if called from a handler
+void input_latency_draw_requested(void);
+
+// draw thread, before fb_draw and after impl->update
+void input_latency_frame_start(void);
+void input_latency_frame_presented(void);
+
+// writes the histogram of the last samples to the log and to path, if not NULL
+void input_latency_dump(const char *path);
+
+#endif
@@ -36,6 +36,8 @@ typedef struct
 {
     void *data;
     touch_callback callback;
+    fb_item_pos *bounds; // optional, see add_touch_handler_rect
+    int capture_id;
 } touch_handler;
 
 struct handler_list_it
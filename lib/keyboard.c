@@ -108,30 +108,43 @@ struct keyboard_btn_data {
 static int keyboard_init_map(struct keyboard *k, const uint32_t *map, const uint32_t *dimen);
 
 
-static int keyboard_charset_switch_worker(UNUSED uint32_t diff, void *data)
+// Runs on the worker pool, rebuilding the buttons would stall animations
+static void keyboard_charset_switch_task(void *data)
 {
     void **keyboard_bnt_data_old = NULL;
     struct keyboard_btn_data *d = data;
-    uint8_t keycode = (d->k->keycode_map[d->btn_idx] & 0xFF);
+    struct keyboard *k = d->k;
+    uint8_t keycode = (k->keycode_map[d->btn_idx] & 0xFF);
 
     fb_batch_start();
-    list_clear(&d->k->btns, &button_destroy);
-    list_swap(&d->k->keyboard_bnt_data, &keyboard_bnt_data_old);
-    keyboard_init_map(d->k, normalKeycodeMapCharsetMapping[keycode - OSK_CHARSET4], normalKeycodeMapDimensions);
+    list_clear(&k->btns, &button_destroy);
+    list_swap(&k->keyboard_bnt_data, &keyboard_bnt_data_old);
+    keyboard_init_map(k, normalKeycodeMapCharsetMapping[keycode - OSK_CHARSET4], normalKeycodeMapDimensions);
     fb_batch_end();
     fb_request_draw();
 
     list_clear(&keyboard_bnt_data_old, free);
-    return 1;
+
+    pthread_mutex_lock(&k->switch_mutex);
+    k->switch_pending = 0;
+    pthread_cond_broadcast(&k->switch_cond);
+    pthread_mutex_unlock(&k->switch_mutex);
 }
 
 static void keyboard_btn_clicked(void *data)
 {
     struct keyboard_btn_data *d = data;
-    uint8_t keycode = (d->k->keycode_map[d->btn_idx] & 0xFF);
+    struct keyboard *k = d->k;
+    uint8_t keycode = (k->keycode_map[d->btn_idx] & 0xFF);
 
     if(keycode >= OSK_CHARSET4 && keycode <= OSK_CHARSET1)
-        workers_add(keyboard_charset_switch_worker, data);
+    {
+        // only one switch at a time, the buttons of this map are about to go away
+        pthread_mutex_lock(&k->switch_mutex);
+        if(!k->switch_pending && workers_post(keyboard_charset_switch_task, data) >= 0)
+            k->switch_pending = 1;
+        pthread_mutex_unlock(&k->switch_mutex);
+    }
     else if(d->k->key_pressed)
         d->k->key_pressed(d->k->key_pressed_data, keycode);
 }
@@ -202,6 +215,8 @@ struct keyboard *keyboard_create(int type, int x, int y, int w, int h)
     k->y = y;
     k->w = w;
     k->h = h;
+    pthread_mutex_init(&k->switch_mutex, NULL);
+    pthread_cond_init(&k->switch_cond, NULL);
 
     switch(type)
     {
@@ -219,8 +234,15 @@ struct keyboard *keyboard_create(int type, int x, int y, int w, int h)
 
 void keyboard_destroy(struct keyboard *k)
 {
+    pthread_mutex_lock(&k->switch_mutex);
+    while(k->switch_pending)
+        pthread_cond_wait(&k->switch_cond, &k->switch_mutex);
+    pthread_mutex_unlock(&k->switch_mutex);
+
     list_clear(&k->btns, &button_destroy);
     list_clear(&k->keyboard_bnt_data, free);
+    pthread_mutex_destroy(&k->switch_mutex);
+    pthread_cond_destroy(&k->switch_cond);
     free(k);
 }
 
@@ -19,6 +19,7 @@
 #define KEYBOARD_H
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "framebuffer.h"
 #include "button.h"
@@ -41,6 +42,9 @@ struct keyboard
     const uint32_t *keycode_map;
     keyboard_on_pressed_callback key_pressed;
     void *key_pressed_data;
+    pthread_mutex_t switch_mutex;
+    pthread_cond_t switch_cond;
+    int switch_pending;
 };
 
 #define KEYBOARD_PIN 0
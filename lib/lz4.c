@@ -0,0 +1,293 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "log.h"
+
+// legacy format is the magic followed by blocks, each prefixed
+// with its compressed size and unpacking to at most 8 MiB
+#define LEGACY_CHUNK_SIZE (8*1024*1024)
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the last 5 bytes are always literals
+#define MF_LIMIT 12 // the last match must start at least 12 bytes before the end
+#define MAX_OFFSET 65535
+#define HASH_LOG 14
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int lz4_decompress_block(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_max, size_t *out_len)
+{
+    const uint8_t *ip = in;
+    const uint8_t *const iend = in + in_len;
+    uint8_t *op = out;
+    uint8_t *const oend = out + out_max;
+    size_t len, offset;
+    uint8_t token, b;
+
+    while(ip < iend)
+    {
+        token = *ip++;
+
+        len = token >> 4;
+        if(len == 15)
+        {
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        // the last sequence has literals only
+        if(ip >= iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - out))
+            return -1;
+
+        len = token & 0x0F;
+        if(len == 15)
+        {
+            do {
+                if(ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        len += MIN_MATCH;
+
+        if((size_t)(oend - op) < len)
+            return -1;
+
+        // may overlap, copy byte by byte
+        while(len--)
+        {
+            *op = *(op - offset);
+            ++op;
+        }
+    }
+
+    *out_len = op - out;
+    return 0;
+}
+
+static uint8_t *lz4_write_len(uint8_t *op, size_t len)
+{
+    for(; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *lz4_write_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if(lit_len >= 15)
+        op = lz4_write_len(op, lit_len - 15);
+
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if(match_len)
+    {
+        *op++ = offset;
+        *op++ = offset >> 8;
+
+        match_len -= MIN_MATCH;
+        *token |= (match_len >= 15 ? 15 : match_len);
+        if(match_len >= 15)
+            op = lz4_write_len(op, match_len - 15);
+    }
+    return op;
+}
+
+// Greedy single-pass compressor, out must have room for lz4_bound(in_len)
+static size_t lz4_compress_block(const uint8_t *in, size_t in_len, uint8_t *out, uint32_t *table)
+{
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *const iend = in + in_len;
+    const uint8_t *const mflimit = iend - MF_LIMIT;
+    const uint8_t *const match_limit = iend - LAST_LITERALS;
+    const uint8_t *ref;
+    uint8_t *op = out;
+    uint32_t seq, h;
+    size_t match_len;
+
+    memset(table, 0, sizeof(uint32_t) << HASH_LOG);
+
+    if(in_len > MF_LIMIT)
+    {
+        while(ip < mflimit)
+        {
+            seq = read32(ip);
+            h = (seq * 2654435761U) >> (32 - HASH_LOG);
+
+            // positions are stored +1 so that 0 means empty
+            ref = table[h] ? in + table[h] - 1 : NULL;
+            table[h] = ip - in + 1;
+
+            if(!ref || ip - ref > MAX_OFFSET || read32(ref) != seq)
+            {
+                ++ip;
+                continue;
+            }
+
+            match_len = MIN_MATCH;
+            while(ip + match_len < match_limit && ref[match_len] == ip[match_len])
+                ++match_len;
+
+            op = lz4_write_sequence(op, anchor, ip - anchor, ip - ref, match_len);
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_write_sequence(op, anchor, iend - anchor, 0, 0);
+    return op - out;
+}
+
+static size_t lz4_bound(size_t len)
+{
+    return len + len/255 + 16;
+}
+
+int lz4_legacy_decompress(const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len)
+{
+    size_t pos = 4;
+    size_t len = 0, alloc = 0;
+    size_t chunk_out;
+    uint32_t chunk;
+    uint8_t *buf = NULL, *tmp;
+
+    if(in_len < 4 || get_le32(in) != LZ4_LEGACY_MAGIC)
+        return -1;
+
+    while(pos + 4 <= in_len)
+    {
+        chunk = get_le32(in + pos);
+        pos += 4;
+
+        // concatenated streams repeat the magic
+        if(chunk == LZ4_LEGACY_MAGIC)
+            continue;
+
+        if(chunk > in_len - pos)
+        {
+            // anything after the last block is padding
+            if(len != 0)
+                break;
+            goto fail;
+        }
+
+        if(alloc < len + LEGACY_CHUNK_SIZE)
+        {
+            alloc = len + LEGACY_CHUNK_SIZE;
+            tmp = realloc(buf, alloc);
+            if(!tmp)
+                goto fail;
+            buf = tmp;
+        }
+
+        if(lz4_decompress_block(in + pos, chunk, buf + len, LEGACY_CHUNK_SIZE, &chunk_out) < 0)
+        {
+            ERROR("lz4: corrupted block at %u\n", (unsigned)pos);
+            goto fail;
+        }
+
+        len += chunk_out;
+        pos += chunk;
+    }
+
+    *out = buf;
+    *out_len = len;
+    return 0;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+int lz4_legacy_compress(const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len)
+{
+    size_t pos, chunk, written;
+    size_t chunks = in_len/LEGACY_CHUNK_SIZE + 1;
+    uint8_t *buf = malloc(4 + chunks*(4 + lz4_bound(LEGACY_CHUNK_SIZE)));
+    uint32_t *table = malloc(sizeof(uint32_t) << HASH_LOG);
+    uint8_t *op;
+
+    if(!buf || !table)
+    {
+        free(buf);
+        free(table);
+        return -1;
+    }
+
+    put_le32(buf, LZ4_LEGACY_MAGIC);
+    op = buf + 4;
+
+    for(pos = 0; pos < in_len; pos += chunk)
+    {
+        chunk = in_len - pos;
+        if(chunk > LEGACY_CHUNK_SIZE)
+            chunk = LEGACY_CHUNK_SIZE;
+
+        written = lz4_compress_block(in + pos, chunk, op + 4, table);
+        put_le32(op, written);
+        op += 4 + written;
+    }
+
+    free(table);
+    *out = buf;
+    *out_len = op - buf;
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * This file is part of MultiROM.
+ *
+ * MultiROM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiROM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiROM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Legacy LZ4 format, the only one the kernel can unpack ramdisks from
+#define LZ4_LEGACY_MAGIC 0x184C2102
+
+// Both return 0 on success, *out is malloc'ed
+int lz4_legacy_decompress(const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len);
+int lz4_legacy_compress(const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len);
+
+#endif
@@ -22,6 +22,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <cutils/android_reboot.h>
@@ -31,6 +32,9 @@
 #endif
 
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -244,31 +248,151 @@ int wait_for_file(const char *filename, int timeout)
     return ret;
 }
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define COPY_BUFF_SIZE (128*1024)
+
+// Returns 0 when done, 1 if the rest has to be copied by other method
+static int copy_fd_range(int in, int out, off_t size)
+{
+#if defined(__NR_copy_file_range)
+    ssize_t res;
+    off_t done = 0;
+
+    while(done < size)
+    {
+        res = syscall(__NR_copy_file_range, in, NULL, out, NULL, size - done, 0);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res < 0 && done == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            return 1;
+        if(res < 0)
+            return -1;
+        // size from stat was wrong, rest is read by the next method
+        if(res == 0)
+            return 1;
+        done += res;
+    }
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+static int copy_fd_sendfile(int in, int out, off_t size)
+{
+    ssize_t res;
+    off_t done = 0;
+    const off_t max_chunk = 0x7ffff000;
+
+    while(done < size)
+    {
+        res = sendfile(out, in, NULL, size - done > max_chunk ? max_chunk : size - done);
+        if(res < 0 && errno == EINTR)
+            continue;
+        if(res < 0 && done == 0 && (errno == ENOSYS || errno == EINVAL))
+            return 1;
+        if(res < 0)
+            return -1;
+        if(res == 0)
+            return 1;
+        done += res;
+    }
+    return 0;
+}
+
+static int copy_fd_buffered(int in, int out)
+{
+    char *buff = malloc(COPY_BUFF_SIZE);
+    ssize_t len, written, res;
+    int ret = -1;
+
+    if(!buff)
+        return -1;
+
+    for(;;)
+    {
+        len = read(in, buff, COPY_BUFF_SIZE);
+        if(len < 0 && errno == EINTR)
+            continue;
+        if(len < 0)
+            goto exit;
+        if(len == 0)
+            break;
+
+        for(written = 0; written < len; written += res)
+        {
+            res = write(out, buff + written, len - written);
+            if(res < 0 && errno == EINTR)
+                res = 0;
+            else if(res <= 0)
+                goto exit;
+        }
+    }
+
+    ret = 0;
+exit:
+    free(buff);
+    return ret;
+}
+
+// Copies contents and mode of file. Shares the data extents if the
+// filesystem supports it, otherwise lets the kernel copy it, and only
+// if that isn't possible goes through a fixed-size buffer.
 int copy_file(const char *from, const char *to)
 {
-    FILE *in = fopen(from, "re");
-    if(!in)
+    struct stat info;
+    int res = -1;
+    int out;
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if(in < 0)
+    {
+        ERROR("copy_file: failed to open %s (%d: %s)\n", from, errno, strerror(errno));
+        return -1;
+    }
+
+    if(fstat(in, &info) < 0)
+    {
+        ERROR("copy_file: failed to stat %s (%d: %s)\n", from, errno, strerror(errno));
+        close(in);
         return -1;
+    }
 
-    FILE *out = fopen(to, "we");
-    if(!out)
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777);
+    if(out < 0)
     {
-        fclose(in);
+        ERROR("copy_file: failed to open %s (%d: %s)\n", to, errno, strerror(errno));
+        close(in);
         return -1;
     }
 
-    fseek(in, 0, SEEK_END);
-    int size = ftell(in);
-    rewind(in);
+    // files in /proc and /sys report size 0, read them the old way
+    if(!S_ISREG(info.st_mode) || info.st_size == 0)
+        res = copy_fd_buffered(in, out);
+    else if(ioctl(out, FICLONE, in) < 0)
+    {
+        res = copy_fd_range(in, out, info.st_size);
+        if(res == 1)
+            res = copy_fd_sendfile(in, out, info.st_size);
+        if(res == 1)
+            res = copy_fd_buffered(in, out);
+    }
+    else
+        res = 0;
+
+    // vfat and fuse don't support modes and return EPERM, the data is what matters
+    if(res == 0 && fchmod(out, info.st_mode & 07777) < 0)
+        INFO("copy_file: failed to set mode of %s (%d: %s)\n", to, errno, strerror(errno));
 
-    char *buff = malloc(size);
-    fread(buff, 1, size, in);
-    fwrite(buff, 1, size, out);
+    if(res < 0)
+        ERROR("copy_file: failed to copy %s to %s (%d: %s)\n", from, to, errno, strerror(errno));
 
-    fclose(in);
-    fclose(out);
-    free(buff);
-    return 0;
+    if(close(out) < 0)
+        res = -1;
+    close(in);
+    return res;
 }
 
 int write_file(const char *path, const char *value)
@@ -374,6 +498,36 @@ int run_cmd_with_env(char **cmd, char *const *envp)
     }
 }
 
+// Returns -1 and kills the command if it doesn't finish in timeout_ms
+int run_cmd_timeout(char **cmd, int timeout_ms)
+{
+    pid_t pID = vfork();
+    if(pID == 0)
+    {
+        stdio_to_null();
+        execve(cmd[0], cmd, NULL);
+        _exit(127);
+    }
+    else if(pID < 0)
+        return -1;
+
+    int status = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(waitpid(pID, &status, WNOHANG) == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(timespec_diff(&start, &now) >= (uint32_t)timeout_ms)
+        {
+            ERROR("%s did not finish in %d ms, killing it\n", cmd[0], timeout_ms);
+            kill(pID, SIGKILL);
+            waitpid(pID, &status, 0);
+            return -1;
+        }
+        usleep(10000);
+    }
+    return status;
+}
 
 char *run_get_stdout(char **cmd)
 {
@@ -686,11 +840,49 @@ int strendswith(const char *haystack, const char *needle)
     return strncmp(haystack + h_len - n_len, needle, n_len) == 0;
 }
 
-int create_loop_device(const char *dev_path, const char *img_path, int loop_num, int loop_chmod)
+#define MAX_LOOP_NUM 1023
+
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+// Added in 5.8, attaches the file and sets status in one call
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t __reserved[8];
+};
+#endif
+
+#define LOOP_CONTROL_PATH "/dev/loop-control"
+#define LOOP_CONTROL_MINOR 237
+
+// Returns -EBUSY if the loop device got used by someone else in the meantime.
+// The device is read-only only if the image can't be opened for writing,
+// a read-only mount of it can still be remounted rw later.
+static int setup_loop_device(const char *dev_path, const char *img_path, int loop_num, int loop_chmod)
 {
     int file_fd, device_fd, res = -1;
+    int read_only = 0;
+    struct loop_config config;
 
     file_fd = open(img_path, O_RDWR | O_CLOEXEC);
+    if (file_fd < 0 && (errno == EROFS || errno == EACCES || errno == EPERM))
+    {
+        read_only = 1;
+        file_fd = open(img_path, O_RDONLY | O_CLOEXEC);
+    }
     if (file_fd < 0) {
         ERROR("Failed to open image %s\n", img_path);
         return -1;
@@ -709,19 +901,39 @@ int create_loop_device(const char *dev_path, const char *img_path, int loop_num,
             INFO("Loop file %s already exists, using it.\n", dev_path);
     }
 
-    device_fd = open(dev_path, O_RDWR | O_CLOEXEC);
+    device_fd = open(dev_path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
     if (device_fd < 0)
     {
         ERROR("Failed to open loop file (%d: %s)\n", errno, strerror(errno));
         goto close_file;
     }
 
+    // Direct I/O skips the page cache of the image file, the filesystem
+    // mounted from the loop device has its own. Kernel ignores it if the
+    // backing filesystem can't do it.
+    memset(&config, 0, sizeof(config));
+    config.fd = file_fd;
+    config.info.lo_flags = LO_FLAGS_DIRECT_IO | (read_only ? LO_FLAGS_READ_ONLY : 0);
+    if (ioctl(device_fd, LOOP_CONFIGURE, &config) >= 0)
+    {
+        res = 0;
+        goto close_dev;
+    }
+    else if (errno == EBUSY)
+    {
+        res = -EBUSY;
+        goto close_dev;
+    }
+
     if (ioctl(device_fd, LOOP_SET_FD, file_fd) < 0)
     {
+        res = (errno == EBUSY) ? -EBUSY : -1;
         ERROR("ioctl LOOP_SET_FD failed on %s (%d: %s)\n", dev_path, errno, strerror(errno));
         goto close_dev;
     }
 
+    ioctl(device_fd, LOOP_SET_DIRECT_IO, 1);
+
     res = 0;
 close_dev:
     close(device_fd);
@@ -730,13 +942,38 @@ close_file:
     return res;
 }
 
-#define MAX_LOOP_NUM 1023
-int mount_image(const char *src, const char *dst, const char *fs, int flags, const void *data)
+int create_loop_device(const char *dev_path, const char *img_path, int loop_num, int loop_chmod)
+{
+    return setup_loop_device(dev_path, img_path, loop_num, loop_chmod);
+}
+
+// Asks the kernel for a free loop device, returns -1 if it can't do that
+static int get_free_loop_num(void)
+{
+    int fd, num;
+
+    fd = open(LOOP_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+    if(fd < 0 && errno == ENOENT &&
+        mknod(LOOP_CONTROL_PATH, S_IFCHR | 0600, makedev(10, LOOP_CONTROL_MINOR)) >= 0)
+    {
+        fd = open(LOOP_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+    }
+
+    if(fd < 0)
+        return -1;
+
+    num = ioctl(fd, LOOP_CTL_GET_FREE);
+    close(fd);
+    return num;
+}
+
+// Finds the first unused loop device by trying them one by one,
+// for kernels without /dev/loop-control
+static int scan_free_loop_num(void)
 {
     char path[64];
     int device_fd;
     int loop_num = 0;
-    int res = -1;
     struct stat info;
     struct loop_info64 lo_info;
 
@@ -758,15 +995,42 @@ int mount_image(const char *src, const char *dst, const char *fs, int flags, con
         }
     }
 
-    if(loop_num == MAX_LOOP_NUM)
+    return loop_num == MAX_LOOP_NUM ? -1 : loop_num;
+}
+
+#define LOOP_BUSY_TRIES 4
+int mount_image(const char *src, const char *dst, const char *fs, int flags, const void *data)
+{
+    char path[64];
+    int loop_num = -1;
+    int res = -1;
+    int i;
+
+    // someone else might take the device between getting and using it
+    for(i = 0; i < LOOP_BUSY_TRIES; ++i)
     {
-        ERROR("mount_image: failed to find suitable loop device number!");
-        return -1;
+        loop_num = get_free_loop_num();
+        if(loop_num < 0)
+            loop_num = scan_free_loop_num();
+
+        if(loop_num < 0)
+        {
+            ERROR("mount_image: failed to find suitable loop device number!");
+            return -1;
+        }
+
+        sprintf(path, "/dev/block/loop%d", loop_num);
+        res = setup_loop_device(path, src, loop_num, 0777);
+        if(res >= 0)
+            break;
+        else if(res != -EBUSY)
+            return -1;
     }
 
-    if(create_loop_device(path, src, loop_num, 0777) < 0)
+    if(i == LOOP_BUSY_TRIES)
         return -1;
 
+    res = -1;
     if(mount(path, dst, fs, flags, data) < 0)
         ERROR("Failed to mount loop (%d: %s)\n", errno, strerror(errno));
     else
@@ -46,6 +46,7 @@ int write_file(const char *path, const char *value);
 int remove_dir(const char *dir);
 int run_cmd(char **cmd);
 int run_cmd_with_env(char **cmd, char *const *envp);
+int run_cmd_timeout(char **cmd, int timeout_ms);
 char *run_get_stdout(char **cmd);
 char *run_get_stdout_with_exit(char **cmd, int *exit_code);
 char *run_get_stdout_with_exit_with_env(char **cmd, int *exit_code, char *const *envp);
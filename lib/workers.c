@@ -38,12 +38,53 @@ struct worker_thread
     volatile int run;
 };
 
+// The main worker thread is kept for latency-sensitive workers (animations),
+// anything which may block goes to the pool so that it can't stall them.
 static struct worker_thread worker_thread = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
     .workers = NULL,
     .run = 0,
 };
 
+struct worker_task
+{
+    worker_task_call call;
+    void *data;
+    struct worker_task *prev;
+    struct worker_task *next;
+};
+
+struct worker_pool_thread
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;       // guards workers
+    struct worker **workers;
+    pthread_mutex_t queue_mutex; // guards the task queue
+    struct worker_task *first;
+    struct worker_task *last;
+};
+
+#define POOL_MAX_THREADS 4
+
+static struct worker_pool
+{
+    struct worker_pool_thread threads[POOL_MAX_THREADS];
+    int count;
+    int next_thread;
+    volatile int run;
+    // pending and next_thread are guarded by wait_mutex
+    int pending;
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_cond;
+} worker_pool = {
+    .count = 0,
+    .next_thread = 0,
+    .run = 0,
+    .pending = 0,
+    .wait_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wait_cond = PTHREAD_COND_INITIALIZER,
+};
+
 #define SLEEP_CONST 10
 static void *worker_thread_work(void *data)
 {
@@ -64,7 +105,7 @@ static void *worker_thread_work(void *data)
         for(w = t->workers; w && *w;)
         {
             if((*w)->call(diff, (*w)->data))
-                w = list_rm_at(&worker_thread.workers, w - t->workers, &free);
+                w = list_rm_at(&t->workers, w - t->workers, &free);
             else
                 ++w;
         }
@@ -83,6 +124,179 @@ static void *worker_thread_work(void *data)
     return NULL;
 }
 
+static struct worker_pool_thread *pool_current_thread(void)
+{
+    int i;
+    pthread_t self = pthread_self();
+    for(i = 0; i < worker_pool.count; ++i)
+        if(pthread_equal(self, worker_pool.threads[i].thread))
+            return &worker_pool.threads[i];
+    return NULL;
+}
+
+static void pool_queue_push(struct worker_pool_thread *t, struct worker_task *task)
+{
+    pthread_mutex_lock(&t->queue_mutex);
+    task->prev = t->last;
+    task->next = NULL;
+    if(t->last)
+        t->last->next = task;
+    else
+        t->first = task;
+    t->last = task;
+    pthread_mutex_unlock(&t->queue_mutex);
+}
+
+// The owner takes the newest task from the back of its own queue,
+// thieves take the oldest one from the front of someone else's.
+static struct worker_task *pool_queue_pop(struct worker_pool_thread *t, int steal)
+{
+    struct worker_task *task;
+
+    pthread_mutex_lock(&t->queue_mutex);
+    task = steal ? t->first : t->last;
+    if(task)
+    {
+        if(task->prev)
+            task->prev->next = task->next;
+        else
+            t->first = task->next;
+
+        if(task->next)
+            task->next->prev = task->prev;
+        else
+            t->last = task->prev;
+    }
+    pthread_mutex_unlock(&t->queue_mutex);
+    return task;
+}
+
+static struct worker_task *pool_take_task(struct worker_pool_thread *t)
+{
+    int i, idx;
+    struct worker_task *task = pool_queue_pop(t, 0);
+
+    idx = t - worker_pool.threads;
+    for(i = 1; !task && i < worker_pool.count; ++i)
+        task = pool_queue_pop(&worker_pool.threads[(idx + i) % worker_pool.count], 1);
+
+    if(task)
+    {
+        pthread_mutex_lock(&worker_pool.wait_mutex);
+        --worker_pool.pending;
+        pthread_mutex_unlock(&worker_pool.wait_mutex);
+    }
+    return task;
+}
+
+static void *pool_thread_work(void *data)
+{
+    struct worker_pool_thread *t = (struct worker_pool_thread*)data;
+    struct worker_task *task;
+    struct worker **w;
+    struct timespec last, curr, deadline;
+    uint32_t diff;
+
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    for(;;)
+    {
+        pthread_mutex_lock(&t->mutex);
+        clock_gettime(CLOCK_MONOTONIC, &curr);
+        diff = timespec_diff(&last, &curr);
+        for(w = t->workers; w && *w;)
+        {
+            if((*w)->call(diff, (*w)->data))
+                w = list_rm_at(&t->workers, w - t->workers, &free);
+            else
+                ++w;
+        }
+        pthread_mutex_unlock(&t->mutex);
+        last = curr;
+
+        while((task = pool_take_task(t)))
+        {
+            task->call(task->data);
+            free(task);
+        }
+
+        pthread_mutex_lock(&worker_pool.wait_mutex);
+        // posted tasks are finished even when stopping, their owners may wait for them
+        if(!worker_pool.run && worker_pool.pending == 0)
+        {
+            pthread_mutex_unlock(&worker_pool.wait_mutex);
+            break;
+        }
+        else if(worker_pool.run && worker_pool.pending == 0)
+        {
+            if(t->workers)
+            {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += SLEEP_CONST*1000000;
+                if(deadline.tv_nsec >= 1000000000)
+                {
+                    ++deadline.tv_sec;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&worker_pool.wait_cond, &worker_pool.wait_mutex, &deadline);
+            }
+            else
+                pthread_cond_wait(&worker_pool.wait_cond, &worker_pool.wait_mutex);
+        }
+        pthread_mutex_unlock(&worker_pool.wait_mutex);
+    }
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    int i;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct worker_pool_thread *t;
+
+    worker_pool.count = cpus < 1 ? 1 : (cpus > POOL_MAX_THREADS ? POOL_MAX_THREADS : cpus);
+    worker_pool.next_thread = 0;
+    worker_pool.pending = 0;
+    worker_pool.run = 1;
+
+    for(i = 0; i < worker_pool.count; ++i)
+    {
+        t = &worker_pool.threads[i];
+        pthread_mutex_init(&t->mutex, NULL);
+        pthread_mutex_init(&t->queue_mutex, NULL);
+        t->workers = NULL;
+        t->first = t->last = NULL;
+    }
+
+    // start the threads only after all queues are initialized, they steal from each other
+    for(i = 0; i < worker_pool.count; ++i)
+        pthread_create(&worker_pool.threads[i].thread, NULL, pool_thread_work, &worker_pool.threads[i]);
+}
+
+static void pool_stop(void)
+{
+    int i;
+    struct worker_pool_thread *t;
+
+    pthread_mutex_lock(&worker_pool.wait_mutex);
+    worker_pool.run = 0;
+    pthread_cond_broadcast(&worker_pool.wait_cond);
+    pthread_mutex_unlock(&worker_pool.wait_mutex);
+
+    for(i = 0; i < worker_pool.count; ++i)
+        pthread_join(worker_pool.threads[i].thread, NULL);
+
+    for(i = 0; i < worker_pool.count; ++i)
+    {
+        t = &worker_pool.threads[i];
+        list_clear(&t->workers, &free);
+        pthread_mutex_destroy(&t->mutex);
+        pthread_mutex_destroy(&t->queue_mutex);
+    }
+    worker_pool.count = 0;
+    worker_pool.pending = 0;
+}
+
 void workers_start(void)
 {
     if(worker_thread.run != 0)
@@ -90,6 +304,8 @@ void workers_start(void)
 
     worker_thread.run = 1;
     pthread_create(&worker_thread.thread, NULL, worker_thread_work, &worker_thread);
+
+    pool_start();
 }
 
 void workers_stop(void)
@@ -101,9 +317,16 @@ void workers_stop(void)
     pthread_join(worker_thread.thread, NULL);
 
     list_clear(&worker_thread.workers, &free);
+
+    pool_stop();
 }
 
 void workers_add(worker_call call, void *data)
+{
+    workers_add_flags(call, data, 0);
+}
+
+void workers_add_flags(worker_call call, void *data, int flags)
 {
     if(worker_thread.run != 1)
     {
@@ -115,11 +338,82 @@ void workers_add(worker_call call, void *data)
     w->call = call;
     w->data = data;
 
+    if(flags & WORKER_POOL)
+    {
+        struct worker_pool_thread *t;
+
+        pthread_mutex_lock(&worker_pool.wait_mutex);
+        t = &worker_pool.threads[worker_pool.next_thread];
+        worker_pool.next_thread = (worker_pool.next_thread + 1) % worker_pool.count;
+        pthread_mutex_unlock(&worker_pool.wait_mutex);
+
+        pthread_mutex_lock(&t->mutex);
+        list_add(&t->workers, w);
+        pthread_mutex_unlock(&t->mutex);
+
+        // wake it up so that it starts ticking
+        pthread_mutex_lock(&worker_pool.wait_mutex);
+        pthread_cond_broadcast(&worker_pool.wait_cond);
+        pthread_mutex_unlock(&worker_pool.wait_mutex);
+        return;
+    }
+
     pthread_mutex_lock(&worker_thread.mutex);
     list_add(&worker_thread.workers, w);
     pthread_mutex_unlock(&worker_thread.mutex);
 }
 
+int workers_post(worker_task_call call, void *data)
+{
+    if(worker_thread.run != 1)
+    {
+        ERROR("workers: posting task when the thread isn't running'\n");
+        return -1;
+    }
+
+    struct worker_task *task = mzalloc(sizeof(struct worker_task));
+    struct worker_pool_thread *t = pool_current_thread();
+    task->call = call;
+    task->data = data;
+
+    pthread_mutex_lock(&worker_pool.wait_mutex);
+    if(!t)
+    {
+        t = &worker_pool.threads[worker_pool.next_thread];
+        worker_pool.next_thread = (worker_pool.next_thread + 1) % worker_pool.count;
+    }
+    // counted before it is queued so that taking it can't go below zero
+    ++worker_pool.pending;
+    pthread_mutex_unlock(&worker_pool.wait_mutex);
+
+    pool_queue_push(t, task);
+
+    pthread_mutex_lock(&worker_pool.wait_mutex);
+    pthread_cond_broadcast(&worker_pool.wait_cond);
+    pthread_mutex_unlock(&worker_pool.wait_mutex);
+    return 0;
+}
+
+static int workers_remove_from(pthread_mutex_t *mutex, struct worker ***workers, worker_call call, void *data)
+{
+    int i, res = -1;
+    struct worker *w;
+
+    pthread_mutex_lock(mutex);
+    for(i = 0; *workers && (*workers)[i]; ++i)
+    {
+        w = (*workers)[i];
+        if(w->call == call && w->data == data)
+        {
+            list_rm_at(workers, i, &free);
+            res = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(mutex);
+    return res;
+}
+
 void workers_remove(worker_call call, void *data)
 {
     if(worker_thread.run != 1)
@@ -128,22 +422,18 @@ void workers_remove(worker_call call, void *data)
         return;
     }
 
-    pthread_mutex_lock(&worker_thread.mutex);
-    if(worker_thread.workers)
+    int i;
+    struct worker_pool_thread *t;
+
+    if(workers_remove_from(&worker_thread.mutex, &worker_thread.workers, call, data) == 0)
+        return;
+
+    for(i = 0; i < worker_pool.count; ++i)
     {
-        int i;
-        struct worker *w;
-        for(i = 0; worker_thread.workers[i]; ++i)
-        {
-            w = worker_thread.workers[i];
-            if(w->call == call && w->data == data)
-            {
-                list_rm_at(&worker_thread.workers, i, &free);
-                break;
-            }
-        }
+        t = &worker_pool.threads[i];
+        if(workers_remove_from(&t->mutex, &t->workers, call, data) == 0)
+            return;
     }
-    pthread_mutex_unlock(&worker_thread.mutex);
 }
 
 pthread_t workers_get_thread_id(void)
@@ -22,10 +22,18 @@
 #include <pthread.h>
 
 typedef int (*worker_call)(uint32_t, void *); // ms_diff, data. Returns 1 if it should be removed
+typedef void (*worker_task_call)(void *); // data
+
+enum
+{
+    WORKER_POOL = 0x01, // run on the worker pool instead of the animation thread
+};
 
 void workers_start(void);
 void workers_stop(void);
 void workers_add(worker_call call, void *data);
+void workers_add_flags(worker_call call, void *data, int flags);
+int workers_post(worker_task_call call, void *data); // runs call(data) once on the pool, even if stopped meanwhile
 void workers_remove(worker_call call, void *data);
 pthread_t workers_get_thread_id(void);
 
@@ -24,6 +24,10 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#ifdef MR_KEXEC_FILE_LOAD
+#include <sys/syscall.h>
+#include <linux/reboot.h>
+#endif
 
 #include "multirom.h"
 #include "lib/framebuffer.h"
@@ -37,10 +41,21 @@
 #define REALDATA "/realdata"
 
 
-static void do_kexec(void)
+static void do_kexec(UNUSED int loaded_in_process)
 {
     emergency_remount_ro();
 
+#ifdef MR_KEXEC_FILE_LOAD
+    if(loaded_in_process)
+    {
+        sync();
+
+        // same thing "kexec -e" does, without exec'ing the binary
+        syscall(__NR_reboot, LINUX_REBOOT_MAGIC1, LINUX_REBOOT_MAGIC2, LINUX_REBOOT_CMD_KEXEC, NULL);
+        ERROR("kexec reboot failed (%d: %s), trying kexec -e\n", errno, strerror(errno));
+    }
+#endif
+
     execl("/kexec", "/kexec", "-e", NULL);
 
     ERROR("kexec -e failed! (%d: %s)", errno, strerror(errno));
@@ -101,7 +116,7 @@ int main(int argc, const char *argv[])
 
         if(exit & EXIT_KEXEC)
         {
-            do_kexec();
+            do_kexec(exit & EXIT_KEXEC_LOADED);
             return 0;
         }
 
@@ -28,6 +28,13 @@
 #include <sys/klog.h>
 #include <linux/loop.h>
 #include <ctype.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <cutils/uevent.h>
+#include <zlib.h>
 
 // clone libbootimg to /system/extras/ from
 // https://github.com/Tasssadar/libbootimg.git
@@ -37,6 +44,7 @@
 #error "libbootimg version 0.2.0 or higher is required. Please update libbootimg."
 #endif
 
+#include "lib/blkprobe.h"
 #include "lib/containers.h"
 #include "lib/framebuffer.h"
 #include "lib/inject.h"
@@ -69,9 +77,22 @@ static char ntfs_path[64] = { 0 };
 static char exfat_path[64] = { 0 };
 static char partition_dir[64] = { 0 };
 
+#define USB_UEVENT_MSG_LEN 2048
+#define USB_DEV_WAIT_TRIES 40
+#define USB_MOUNT_THREADS 4
+// in ms, kernel mounts can't be interrupted so only FUSE ones have a deadline
+#define USB_MOUNT_TIMEOUT_NTFS 15000
+#define USB_MOUNT_TIMEOUT_EXFAT 10000
+
 static volatile int run_usb_refresh = 0;
 static pthread_t usb_refresh_thread;
+static int usb_refresh_wake_fd = -1;
+static char **usb_mounting = NULL; // names of partitions being mounted, guarded by parts_mutex
 static pthread_mutex_t parts_mutex = PTHREAD_MUTEX_INITIALIZER;
+// threads mounting hotplugged partitions, stopping the refresh thread waits for them
+static int usb_add_jobs = 0;
+static pthread_mutex_t usb_add_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usb_add_jobs_cond = PTHREAD_COND_INITIALIZER;
 static void (*usb_refresh_handler)(void) = NULL;
 
 int multirom_find_base_dir(void)
@@ -186,6 +207,9 @@ int multirom(const char *rom_to_boot)
     {
         s.auto_boot_type &= ~(AUTOBOOT_FORCE_CURRENT);
 
+        // the scripts may change boot.img, nothing else may touch it now
+        multirom_kexec_prepare_cancel();
+
         if(rom_to_boot == NULL)
             multirom_run_scripts("run-on-boot", to_boot);
 
@@ -374,6 +398,370 @@ static int compare_rom_names(const void *a, const void *b)
     return 0;
 }
 
+enum
+{
+    ROM_DIR_BOOT        = 0x0001,
+    ROM_DIR_SYSTEM      = 0x0002,
+    ROM_DIR_DATA        = 0x0004,
+    ROM_DIR_CACHE       = 0x0008,
+    ROM_DIR_SYSTEM_IMG  = 0x0010,
+    ROM_DIR_DATA_IMG    = 0x0020,
+    ROM_DIR_CACHE_IMG   = 0x0040,
+    ROM_DIR_ROM_INFO    = 0x0080,
+    ROM_DIR_ROOT        = 0x0100,
+    ROM_DIR_ROOT_IMG    = 0x0200,
+    ROM_DIR_BOOT_IMG    = 0x0400,
+};
+
+static const struct
+{
+    const char *name;
+    int flag;
+} rom_dir_entries[] = {
+    { "boot",         ROM_DIR_BOOT },
+    { "system",       ROM_DIR_SYSTEM },
+    { "data",         ROM_DIR_DATA },
+    { "cache",        ROM_DIR_CACHE },
+    { "system.img",   ROM_DIR_SYSTEM_IMG },
+    { "data.img",     ROM_DIR_DATA_IMG },
+    { "cache.img",    ROM_DIR_CACHE_IMG },
+    { "rom_info.txt", ROM_DIR_ROM_INFO },
+    { "root",         ROM_DIR_ROOT },
+    { "root.img",     ROM_DIR_ROOT_IMG },
+    { "boot.img",     ROM_DIR_BOOT_IMG },
+    { NULL, 0 },
+};
+
+// Reads the ROM dir once instead of resolving each path through
+// the (possibly FUSE) mount, returns ROM_DIR_* flags of what is there.
+// Names are compared like the filesystem of the ROM's partition does it,
+// vfat and exfat drives may have BOOT.IMG and the like. ntfs-3g is case
+// sensitive, so "System" there is not the "system" the ROM is booted from.
+static int multirom_scan_rom_dir(struct multirom_rom *rom)
+{
+    const char *path = rom->base_path;
+    const int ignore_case = rom->partition && rom->partition->fs &&
+            (strcmp(rom->partition->fs, "vfat") == 0 || strcmp(rom->partition->fs, "exfat") == 0);
+    DIR *d;
+    struct dirent *dr;
+    int i, res = 0;
+
+    d = opendir(path);
+    if(!d)
+        return 0;
+
+    while((dr = readdir(d)))
+    {
+        if(dr->d_name[0] == '.')
+            continue;
+
+        for(i = 0; rom_dir_entries[i].name; ++i)
+        {
+            if((ignore_case ? strcasecmp(dr->d_name, rom_dir_entries[i].name) :
+                strcmp(dr->d_name, rom_dir_entries[i].name)) == 0)
+            {
+                res |= rom_dir_entries[i].flag;
+                break;
+            }
+        }
+    }
+    closedir(d);
+    return res;
+}
+
+/*
+ * ROM index: remembers the probing results of each ROM dir, keyed by its
+ * path (and partition UUID for USB ROMs). An entry is trusted as long as
+ * the mtimes of the ROM dir and of its .icon_data are unchanged.
+ * Only entries used during this run are written back.
+ */
+#define ROM_INDEX_FILE "roms.idx"
+#define ROM_INDEX_HEADER "mrom_rom_index 1\n"
+
+struct rom_index_entry
+{
+    int64_t dir_mtime[2];
+    int64_t icon_data_mtime[2];
+    int type;
+    int has_bootimg;
+    char *icon_path;
+    int used;
+};
+
+static map *rom_index = NULL;
+static int rom_index_dirty = 0;
+static pthread_mutex_t rom_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void rom_index_free_entry(void *entry)
+{
+    free(((struct rom_index_entry*)entry)->icon_path);
+    free(entry);
+}
+
+static void rom_index_load(void)
+{
+    char path[256];
+    char line[1024];
+    char *key, *icon;
+    int off;
+    long long dir_s, dir_ns, ic_s, ic_ns;
+    struct rom_index_entry *e;
+    FILE *f;
+
+    if(rom_index)
+        return;
+
+    rom_index = map_create();
+
+    snprintf(path, sizeof(path), "%s/"ROM_INDEX_FILE, mrom_dir());
+    f = fopen(path, "re");
+    if(!f)
+        return;
+
+    if(!fgets(line, sizeof(line), f) || strcmp(line, ROM_INDEX_HEADER) != 0)
+    {
+        fclose(f);
+        return;
+    }
+
+    while(fgets(line, sizeof(line), f))
+    {
+        e = mzalloc(sizeof(struct rom_index_entry));
+        off = 0;
+        if(sscanf(line, "%lld %lld %lld %lld %d %d %n", &dir_s, &dir_ns, &ic_s, &ic_ns,
+                &e->type, &e->has_bootimg, &off) != 6 || off == 0)
+        {
+            free(e);
+            continue;
+        }
+
+        key = line + off;
+        icon = strchr(key, '\t');
+        if(!icon)
+        {
+            free(e);
+            continue;
+        }
+        *icon++ = 0;
+        icon[strcspn(icon, "\n")] = 0;
+
+        e->dir_mtime[0] = dir_s;
+        e->dir_mtime[1] = dir_ns;
+        e->icon_data_mtime[0] = ic_s;
+        e->icon_data_mtime[1] = ic_ns;
+        e->icon_path = strdup(icon);
+        map_add(rom_index, key, e, &rom_index_free_entry);
+    }
+    fclose(f);
+}
+
+static void rom_index_save(void)
+{
+    char path[256];
+    char tmp[256];
+    struct rom_index_entry *e;
+    size_t i;
+    FILE *f;
+
+    if(!rom_index)
+        return;
+
+    // entries of removed ROMs are dropped too
+    for(i = 0; !rom_index_dirty && i < rom_index->size; ++i)
+        if(!((struct rom_index_entry*)rom_index->values[i])->used)
+            rom_index_dirty = 1;
+
+    if(!rom_index_dirty)
+        return;
+
+    // written next to the index and renamed over it,
+    // so that an interrupted write can't leave it truncated
+    snprintf(path, sizeof(path), "%s/"ROM_INDEX_FILE, mrom_dir());
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "we");
+    if(!f)
+    {
+        ERROR("Failed to open %s for writing!\n", tmp);
+        return;
+    }
+
+    fputs(ROM_INDEX_HEADER, f);
+    for(i = 0; i < rom_index->size; ++i)
+    {
+        e = rom_index->values[i];
+        if(!e->used)
+            continue;
+
+        fprintf(f, "%lld %lld %lld %lld %d %d %s\t%s\n",
+                (long long)e->dir_mtime[0], (long long)e->dir_mtime[1],
+                (long long)e->icon_data_mtime[0], (long long)e->icon_data_mtime[1],
+                e->type, e->has_bootimg, rom_index->keys[i], e->icon_path);
+    }
+
+    if(fflush(f) != 0 || fsync(fileno(f)) < 0 || ferror(f))
+    {
+        ERROR("Failed to write %s!\n", tmp);
+        fclose(f);
+        remove(tmp);
+        return;
+    }
+    fclose(f);
+
+    if(rename(tmp, path) < 0)
+    {
+        ERROR("Failed to rename %s to %s (%d: %s)\n", tmp, path, errno, strerror(errno));
+        remove(tmp);
+        return;
+    }
+    rom_index_dirty = 0;
+}
+
+static void rom_index_destroy(void)
+{
+    map_destroy(rom_index, &rom_index_free_entry);
+    rom_index = NULL;
+    rom_index_dirty = 0;
+}
+
+static void rom_index_key(struct multirom_rom *rom, char *buff, size_t size)
+{
+    if(rom->partition)
+        snprintf(buff, size, "%s:%s", rom->partition->uuid ? rom->partition->uuid : "", rom->base_path);
+    else
+        snprintf(buff, size, "%s", rom->base_path);
+}
+
+static int multirom_get_rom_type_flags(struct multirom_rom *rom, int flags);
+
+static void multirom_probe_rom(struct multirom_rom *rom)
+{
+    char path[256];
+    char key[512];
+    struct stat info;
+    struct rom_index_entry *e, *cached = NULL;
+    int flags;
+    int64_t dir_mtime[2] = { 0, 0 };
+    int64_t icon_data_mtime[2] = { 0, 0 };
+
+    if(stat(rom->base_path, &info) >= 0)
+    {
+        dir_mtime[0] = info.st_mtime;
+        dir_mtime[1] = info.st_mtime_nsec;
+    }
+
+    snprintf(path, sizeof(path), "%s/.icon_data", rom->base_path);
+    if(stat(path, &info) >= 0)
+    {
+        icon_data_mtime[0] = info.st_mtime;
+        icon_data_mtime[1] = info.st_mtime_nsec;
+    }
+
+    rom_index_key(rom, key, sizeof(key));
+
+    pthread_mutex_lock(&rom_index_mutex);
+    if(rom_index)
+        cached = map_get_val(rom_index, key);
+    // the icon itself lives outside of the ROM dir and might have been deleted
+    if(cached && memcmp(cached->dir_mtime, dir_mtime, sizeof(dir_mtime)) == 0 &&
+        memcmp(cached->icon_data_mtime, icon_data_mtime, sizeof(icon_data_mtime)) == 0 &&
+        access(cached->icon_path, F_OK) >= 0)
+    {
+        rom->type = cached->type;
+        rom->has_bootimg = cached->has_bootimg;
+        rom->icon_path = strdup(cached->icon_path);
+        cached->used = 1;
+        pthread_mutex_unlock(&rom_index_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&rom_index_mutex);
+
+    flags = multirom_scan_rom_dir(rom);
+    rom->type = multirom_get_rom_type_flags(rom, flags);
+    // type only needs boot.img to exist, booting it needs to read it
+    if(flags & ROM_DIR_BOOT_IMG)
+    {
+        snprintf(path, sizeof(path), "%s/boot.img", rom->base_path);
+        rom->has_bootimg = access(path, R_OK) == 0 ? 1 : 0;
+    }
+    else
+        rom->has_bootimg = 0;
+
+    multirom_find_rom_icon(rom);
+
+    e = mzalloc(sizeof(struct rom_index_entry));
+    memcpy(e->dir_mtime, dir_mtime, sizeof(dir_mtime));
+    memcpy(e->icon_data_mtime, icon_data_mtime, sizeof(icon_data_mtime));
+    e->type = rom->type;
+    e->has_bootimg = rom->has_bootimg;
+    e->icon_path = strdup(rom->icon_path);
+    e->used = 1;
+
+    pthread_mutex_lock(&rom_index_mutex);
+    if(rom_index)
+    {
+        map_add(rom_index, key, e, &rom_index_free_entry);
+        rom_index_dirty = 1;
+    }
+    else
+        rom_index_free_entry(e);
+    pthread_mutex_unlock(&rom_index_mutex);
+}
+
+#define ROM_PROBE_THREADS 4
+
+struct rom_probe_ctx
+{
+    struct multirom_rom **roms;
+    int next;
+    pthread_mutex_t mutex;
+};
+
+static void *multirom_probe_roms_work(void *data)
+{
+    struct rom_probe_ctx *ctx = data;
+    struct multirom_rom *rom;
+
+    while(1)
+    {
+        pthread_mutex_lock(&ctx->mutex);
+        rom = ctx->roms[ctx->next];
+        if(rom)
+            ++ctx->next;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if(!rom)
+            break;
+
+        multirom_probe_rom(rom);
+    }
+    return NULL;
+}
+
+// Probing is mostly waiting for the (possibly FUSE) filesystem,
+// so the ROMs are probed in parallel. The caller sorts them afterwards.
+static void multirom_probe_roms(struct multirom_rom **roms)
+{
+    pthread_t threads[ROM_PROBE_THREADS-1];
+    struct rom_probe_ctx ctx = {
+        .roms = roms,
+        .next = 0,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+    int i, started = 0;
+    const int cnt = imin(list_item_count(roms), ROM_PROBE_THREADS) - 1;
+
+    for(i = 0; i < cnt; ++i)
+        if(pthread_create(&threads[started], NULL, multirom_probe_roms_work, &ctx) == 0)
+            ++started;
+
+    multirom_probe_roms_work(&ctx);
+
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&ctx.mutex);
+}
+
 int multirom_default_status(struct multirom_status *s)
 {
     s->is_second_boot = 0;
@@ -408,6 +796,8 @@ int multirom_default_status(struct multirom_status *s)
         return -1;
     }
 
+    rom_index_load();
+
     struct dirent *dr;
     char path[256];
     struct multirom_rom **add_roms = NULL;
@@ -436,13 +826,6 @@ int multirom_default_status(struct multirom_status *s)
         sprintf(path, "%s/%s", roms_path, rom->name);
         rom->base_path = strdup(path);
 
-        rom->type = multirom_get_rom_type(rom);
-
-        sprintf(path, "%s/boot.img", rom->base_path);
-        rom->has_bootimg = access(path, R_OK) == 0 ? 1 : 0;
-
-        multirom_find_rom_icon(rom);
-
         list_add(&add_roms, rom);
     }
 
@@ -450,6 +833,8 @@ int multirom_default_status(struct multirom_status *s)
 
     if(add_roms)
     {
+        multirom_probe_roms(add_roms);
+
         // sort roms
         qsort(add_roms, list_item_count(add_roms), sizeof(struct multirom_rom*), compare_rom_names);
 
@@ -536,6 +921,12 @@ int multirom_load_status(struct multirom_status *s)
             s->force_generic_fb = atoi(arg);
         else if(strstr(name, "anim_duration_coef_pct"))
             s->anim_duration_coef = ((float)atoi(arg)) / 100;
+        else if(strstr(name, "anim_frame_sync"))
+            s->anim_frame_sync = atoi(arg);
+        else if(strstr(name, "input_record"))
+            s->input_record = atoi(arg);
+        else if(strstr(name, "input_replay_speed_pct"))
+            s->input_replay_speed_pct = atoi(arg);
     }
 
     fclose(f);
@@ -608,6 +999,8 @@ int multirom_save_status(struct multirom_status *s)
     char auto_boot_name[MAX_ROM_NAME_LEN+1];
     char current_name[MAX_ROM_NAME_LEN+1];
 
+    rom_index_save();
+
     snprintf(path, sizeof(path), "%s/multirom.ini", mrom_dir());
 
     FILE *f = fopen(path, "we");
@@ -633,6 +1026,9 @@ int multirom_save_status(struct multirom_status *s)
     fprintf(f, "rotation=%d\n", s->rotation);
     fprintf(f, "force_generic_fb=%d\n", s->force_generic_fb);
     fprintf(f, "anim_duration_coef_pct=%d\n", (int)(s->anim_duration_coef*100));
+    fprintf(f, "anim_frame_sync=%d\n", s->anim_frame_sync);
+    fprintf(f, "input_record=%d\n", s->input_record);
+    fprintf(f, "input_replay_speed_pct=%d\n", s->input_replay_speed_pct);
 
     fclose(f);
     return 0;
@@ -665,6 +1061,9 @@ void multirom_dump_status(struct multirom_status *s)
     INFO("  rotation=%d\n", s->rotation);
     INFO("  force_generic_fb=%d\n", s->force_generic_fb);
     INFO("  anim_duration_coef=%f\n", s->anim_duration_coef);
+    INFO("  anim_frame_sync=%d\n", s->anim_frame_sync);
+    INFO("  input_record=%d\n", s->input_record);
+    INFO("  input_replay_speed_pct=%d\n", s->input_replay_speed_pct);
     INFO("  hide_internal=%d\n", s->hide_internal);
     INFO("  int_display_name=%s\n", s->int_display_name ? s->int_display_name : "NULL");
     INFO("  auto_boot_seconds=%d\n", s->auto_boot_seconds);
@@ -686,13 +1085,18 @@ void multirom_dump_status(struct multirom_status *s)
     }
 }
 
+static void multirom_kexec_prepare_free(void);
+
 void multirom_free_status(struct multirom_status *s)
 {
+    multirom_kexec_prepare_free();
     list_clear(&s->partitions, &multirom_destroy_partition);
+    list_clear(&s->removed_partitions, &multirom_destroy_partition);
     list_clear(&s->roms, &multirom_free_rom);
     free(s->curr_rom_part);
     free(s->int_display_name);
     fstab_destroy(s->fstab);
+    rom_index_destroy();
 }
 
 void multirom_free_rom(void *rom)
@@ -703,26 +1107,35 @@ void multirom_free_rom(void *rom)
     free(rom);
 }
 
+static int multirom_has_partition(struct multirom_status *s, struct usb_partition *p)
+{
+    int i;
+    for(i = 0; s->partitions && s->partitions[i]; ++i)
+        if(s->partitions[i] == p)
+            return 1;
+    return 0;
+}
+
+// Only drops ROMs of removed partitions and scans the new ones, so ROMs
+// on partitions which stayed connected keep their ids.
 void multirom_find_usb_roms(struct multirom_status *s)
 {
-    // remove USB roms
     int i;
+
+    pthread_mutex_lock(&parts_mutex);
     for(i = 0; s->roms && s->roms[i];)
     {
-        if(s->roms[i]->partition)
-        {
+        if(s->roms[i]->partition && !multirom_has_partition(s, s->roms[i]->partition))
             list_rm_at(&s->roms, i, &multirom_free_rom);
-            i = 0;
-        }
         else ++i;
     }
 
-    char path[256];
-    struct usb_partition *p;
+    // nothing references them anymore
+    list_clear(&s->removed_partitions, &multirom_destroy_partition);
 
-    pthread_mutex_lock(&parts_mutex);
     for(i = 0; s->partitions && s->partitions[i]; ++i)
-        multirom_scan_partition_for_roms(s, s->partitions[i]);
+        if(!s->partitions[i]->scanned)
+            multirom_scan_partition_for_roms(s, s->partitions[i]);
     pthread_mutex_unlock(&parts_mutex);
 
     multirom_dump_status(s);
@@ -735,6 +1148,8 @@ int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_parti
     struct dirent *dr;
     struct multirom_rom **add_roms = NULL;
 
+    p->scanned = 1;
+
 #ifdef MR_MOVE_USB_DIR
     // groupers will have old "multirom" folder on USB drive instead of "multirom-grouper".
     // We have to move it.
@@ -783,12 +1198,6 @@ int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_parti
         rom->base_path = strdup(path);
 
         rom->partition = p;
-        rom->type = multirom_get_rom_type(rom);
-
-        sprintf(path, "%s/boot.img", rom->base_path);
-        rom->has_bootimg = access(path, R_OK) == 0 ? 1 : 0;
-
-        multirom_find_rom_icon(rom);
 
         list_add(&add_roms, rom);
     }
@@ -796,6 +1205,8 @@ int multirom_scan_partition_for_roms(struct multirom_status *s, struct usb_parti
 
     if(add_roms)
     {
+        multirom_probe_roms(add_roms);
+
         // sort roms
         qsort(add_roms, list_item_count(add_roms), sizeof(struct multirom_rom*), compare_rom_names);
 
@@ -814,7 +1225,9 @@ int multirom_path_exists(char *base, char *filename)
     return 0;
 }
 
-int multirom_get_rom_type(struct multirom_rom *rom)
+#define HAS_ALL(flags, f) (((flags) & (f)) == (f))
+
+static int multirom_get_rom_type_flags(struct multirom_rom *rom, int flags)
 {
     if(!rom->partition && strcmp(rom->name, INTERNAL_ROM_NAME) == 0)
         return ROM_DEFAULT;
@@ -822,23 +1235,21 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     char *b = rom->base_path;
 
     // Handle android ROMs
-    if(!multirom_path_exists(b, "boot"))
+    if(flags & ROM_DIR_BOOT)
     {
-        if (!multirom_path_exists(b, "system") && !multirom_path_exists(b, "data") &&
-            !multirom_path_exists(b, "cache"))
+        if(HAS_ALL(flags, ROM_DIR_SYSTEM | ROM_DIR_DATA | ROM_DIR_CACHE))
         {
             if(!rom->partition) return ROM_ANDROID_INTERNAL;
             else                return ROM_ANDROID_USB_DIR;
         }
-        else if(!multirom_path_exists(b, "system.img") && !multirom_path_exists(b, "data.img") &&
-                !multirom_path_exists(b, "cache.img"))
+        else if(HAS_ALL(flags, ROM_DIR_SYSTEM_IMG | ROM_DIR_DATA_IMG | ROM_DIR_CACHE_IMG))
         {
             return ROM_ANDROID_USB_IMG;
         }
     }
 
     // handle linux ROMs
-    if(!multirom_path_exists(b, "rom_info.txt"))
+    if(flags & ROM_DIR_ROM_INFO)
     {
         if(!rom->partition)
             return ROM_LINUX_INTERNAL;
@@ -847,8 +1258,8 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     }
 
     // Handle Ubuntu 13.04 - deprecated
-    if ((!multirom_path_exists(b, "root") && multirom_path_exists(b, "boot.img")) ||
-       (!multirom_path_exists(b, "root.img") && rom->partition))
+    if (((flags & ROM_DIR_ROOT) && !(flags & ROM_DIR_BOOT_IMG)) ||
+       ((flags & ROM_DIR_ROOT_IMG) && rom->partition))
     {
         // try to copy rom_info.txt in there, ubuntu is deprecated
         ERROR("Found deprecated Ubuntu 13.04, trying to copy rom_info.txt...\n");
@@ -875,7 +1286,7 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     }
 
     // Handle ubuntu 12.10
-    if(!multirom_path_exists(b, "root") && !multirom_path_exists(b, "boot.img"))
+    if(HAS_ALL(flags, ROM_DIR_ROOT | ROM_DIR_BOOT_IMG))
     {
         if(!rom->partition) return ROM_UNSUPPORTED_INT;
         else                return ROM_UNSUPPORTED_USB;
@@ -884,6 +1295,11 @@ int multirom_get_rom_type(struct multirom_rom *rom)
     return ROM_UNKNOWN;
 }
 
+int multirom_get_rom_type(struct multirom_rom *rom)
+{
+    return multirom_get_rom_type_flags(rom, multirom_scan_rom_dir(rom));
+}
+
 void multirom_import_internal(void)
 {
     char path[256];
@@ -966,9 +1382,12 @@ int multirom_prepare_for_boot(struct multirom_status *s, struct multirom_rom *to
 
     if(((M(type) & MASK_KEXEC) || to_boot->has_bootimg) && type != ROM_DEFAULT && s->is_second_boot == 0)
     {
-        if(multirom_load_kexec(s, to_boot) != 0)
+        int res = multirom_load_kexec(s, to_boot);
+        if(res < 0)
             return -1;
         exit |= EXIT_KEXEC;
+        if(res == 1)
+            exit |= EXIT_KEXEC_LOADED;
     }
 
     switch(type)
@@ -1461,6 +1880,109 @@ int multirom_get_trampoline_ver(void)
     return ver;
 }
 
+#define KEXEC_CHECK_FILE "kexec_check"
+
+// Kernel release and build time, changes with every kernel build
+static void multirom_get_kernel_id(char *id, size_t size)
+{
+    struct utsname u;
+    if(uname(&u) < 0)
+        id[0] = 0;
+    else
+        snprintf(id, size, "%s %s", u.release, u.version);
+}
+
+static int multirom_load_kexec_check(const char *kernel_id)
+{
+    char path[256];
+    char line[512];
+    int res = -1;
+    FILE *f;
+
+    if(!kernel_id[0])
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/"KEXEC_CHECK_FILE, mrom_dir());
+    f = fopen(path, "re");
+    if(!f)
+        return -1;
+
+    if(fgets(line, sizeof(line), f) && strncmp(line, kernel_id, strlen(kernel_id)) == 0 &&
+        line[strlen(kernel_id)] == '\n' && fgets(line, sizeof(line), f))
+    {
+        res = atoi(line) != 0;
+    }
+
+    fclose(f);
+    return res;
+}
+
+static void multirom_save_kexec_check(const char *kernel_id, int has_kexec)
+{
+    char path[256];
+    FILE *f;
+
+    if(!kernel_id[0])
+        return;
+
+    snprintf(path, sizeof(path), "%s/"KEXEC_CHECK_FILE, mrom_dir());
+    f = fopen(path, "we");
+    if(!f)
+        return;
+
+    fprintf(f, "%s\n%d\n", kernel_id, has_kexec);
+    fclose(f);
+}
+
+// Goes through /proc/config.gz once, returns 1 if all options are set
+static int multirom_check_kernel_config(void)
+{
+    static const char *checks[] = {
+        "CONFIG_KEXEC_HARDBOOT=y",
+#ifndef MR_KEXEC_DTB
+        "CONFIG_ATAGS_PROC=y",
+#else
+        "CONFIG_PROC_DEVICETREE=y",
+#endif
+    };
+    uint32_t found = 0;
+    uint32_t i;
+    size_t len;
+    int line_start, line_cont = 0;
+    char line[256];
+    gzFile f;
+
+    f = gzopen("/proc/config.gz", "rb");
+    if(!f)
+    {
+        ERROR("Failed to open /proc/config.gz!\n");
+        return 0;
+    }
+
+    while(found != (1u << ARRAY_SIZE(checks)) - 1 && gzgets(f, line, sizeof(line)))
+    {
+        // rest of a line longer than the buffer
+        line_start = !line_cont;
+        line_cont = strchr(line, '\n') == NULL;
+        if(!line_start || strncmp(line, "CONFIG_", 7) != 0)
+            continue;
+
+        for(i = 0; i < ARRAY_SIZE(checks); ++i)
+        {
+            len = strlen(checks[i]);
+            if(strncmp(line, checks[i], len) == 0 && (line[len] == '\n' || line[len] == 0))
+                found |= (1 << i);
+        }
+    }
+    gzclose(f);
+
+    for(i = 0; i < ARRAY_SIZE(checks); ++i)
+        if(!(found & (1 << i)))
+            ERROR("%s not found in /proc/config.gz!\n", checks[i]);
+
+    return found == (1u << ARRAY_SIZE(checks)) - 1;
+}
+
 int multirom_has_kexec(void)
 {
     static int has_kexec = -1;
@@ -1475,36 +1997,15 @@ int multirom_has_kexec(void)
 
     if(access("/proc/config.gz", F_OK) >= 0)
     {
-        char *cmd_cp[] = { busybox_path, "cp", "/proc/config.gz", "/ikconfig.gz", NULL };
-        run_cmd(cmd_cp);
+        char kernel_id[512];
+        multirom_get_kernel_id(kernel_id, sizeof(kernel_id));
 
-        char *cmd_gzip[] = { busybox_path, "gzip", "-d", "/ikconfig.gz", NULL };
-        run_cmd(cmd_gzip);
-
-        has_kexec = 1;
-
-        uint32_t i;
-        static const char *checks[] = {
-            "CONFIG_KEXEC_HARDBOOT=y",
-#ifndef MR_KEXEC_DTB
-            "CONFIG_ATAGS_PROC=y",
-#else
-            "CONFIG_PROC_DEVICETREE=y",
-#endif
-        };
-        //                   0             1       2     3
-        char *cmd_grep[] = { busybox_path, "grep", NULL, "/ikconfig", NULL };
-        for(i = 0; i < ARRAY_SIZE(checks); ++i)
+        has_kexec = multirom_load_kexec_check(kernel_id);
+        if(has_kexec == -1)
         {
-            cmd_grep[2] = (char*)checks[i];
-            if(run_cmd(cmd_grep) != 0)
-            {
-                has_kexec = 0;
-                ERROR("%s not found in /proc/config.gz!\n", checks[i]);
-            }
+            has_kexec = multirom_check_kernel_config();
+            multirom_save_kexec_check(kernel_id, has_kexec);
         }
-
-        remove("/ikconfig");
     }
     else
     {
@@ -1625,6 +2126,8 @@ int multirom_find_file(char *res, const char *name_part, const char *path)
     return ret;
 }
 
+// Returns 1 if the kernel was loaded in-process by kexec_file_load,
+// 0 if it was loaded by the kexec binary, -1 on failure
 int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom)
 {
     int res = -1;
@@ -1664,6 +2167,8 @@ int multirom_load_kexec(struct multirom_status *s, struct multirom_rom *rom)
     }
 
     res = kexec_load_exec(&kexec);
+    if(res == 0 && kexec.loaded)
+        res = 1;
 
     char *cmd_cp[] = { busybox_path, "cp", kexec_path, "/kexec", NULL };
     run_cmd(cmd_cp);
@@ -1679,73 +2184,582 @@ exit:
     return res;
 }
 
-int multirom_fill_kexec_android(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec)
+struct kexec_android_img
 {
-    int res = -1;
-    char img_path[256];
-    snprintf(img_path, sizeof(img_path), "%s/boot.img", rom->base_path);
+    struct bootimg img;
+    char cmdline[1536];
+    struct stat st; // of boot.img, to find out if it changed after it was loaded
+    int needs_write; // trampoline was updated only in memory
+};
+
+// Fills "--command-line=" argument from boot.img's header and bootloader's cmdline
+static void multirom_build_kexec_cmdline(struct multirom_status *s, struct boot_img_hdr *hdr, char *cmdline, size_t size)
+{
+    strcpy(cmdline, "--command-line=");
+
+    if(hdr->cmdline[0] != 0)
+    {
+        hdr->cmdline[BOOT_ARGS_SIZE-1] = 0;
+
+        // see multirom_get_bootloader_cmdline
+#if MR_DEVICE_HOOKS >= 5
+        mrom_hook_fixup_bootimg_cmdline((char*)hdr->cmdline, BOOT_ARGS_SIZE);
+#endif
+
+        strcat(cmdline, (char*)hdr->cmdline);
+        strcat(cmdline, " ");
+    }
+
+    if(multirom_get_bootloader_cmdline(s, cmdline+strlen(cmdline), size-strlen(cmdline)-1) == -1)
+        ERROR("Failed to get cmdline\n");
+
+    if(!strstr(cmdline, " mrom_kexecd=1") && size-strlen(cmdline)-1 >= sizeof("mrom_kexecd=1"))
+        strcat(cmdline, "mrom_kexecd=1");
+}
+
+/*
+ * Extracted kernel, ramdisk and dtb of Android ROMs are kept in
+ * <mrom_dir>/boot_cache/<key>/. The key is the hash mkbootimg puts into
+ * the header together with device, inode, size and mtime of boot.img,
+ * because many tools leave the hash zeroed or stale when they edit the image.
+ * The kexec binary reads them from there, so repeated boots of the same ROM
+ * only read boot.img's header. Least recently used entries are removed
+ * when there are too many or /data is getting full.
+ */
+#define BOOT_CACHE_DIR "boot_cache"
+#define BOOT_CACHE_KEY_LEN 128
+#define BOOT_CACHE_MAX_ENTRIES 6
+#define BOOT_CACHE_MIN_FREE (512LL*1024*1024)
+
+struct boot_cache_entry
+{
+    char name[BOOT_CACHE_KEY_LEN];
+    time_t used;
+};
+
+static int boot_cache_key(struct boot_img_hdr *hdr, const char *img_path, char *key)
+{
+    struct stat info;
+
+    if(stat(img_path, &info) < 0)
+        return -1;
+
+    // only the first 20 bytes of id are SHA1
+    snprintf(key, BOOT_CACHE_KEY_LEN, "%08x%08x%08x%08x%08x-%llx-%llx-%llx-%llx.%lx",
+            hdr->id[0], hdr->id[1], hdr->id[2], hdr->id[3], hdr->id[4],
+            (unsigned long long)info.st_dev, (unsigned long long)info.st_ino,
+            (unsigned long long)info.st_size, (unsigned long long)info.st_mtime,
+            (unsigned long)info.st_mtime_nsec);
+    return 0;
+}
+
+static int boot_cache_file_matches(const char *dir, const char *name, uint32_t size)
+{
+    char path[256];
+    struct stat info;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &info) >= 0 && info.st_size == (off_t)size;
+}
+
+// Fills the header and dir of cached artifacts, returns 0 if they can be used
+static int boot_cache_lookup(const char *img_path, struct boot_img_hdr *hdr, char *dir, size_t dir_size)
+{
+    char key[BOOT_CACHE_KEY_LEN];
+
+    if(libbootimg_load_header(hdr, img_path) < 0)
+        return -1;
+
+    // outdated trampoline, boot.img has to be updated
+    if(inject_get_trampoline_ver(hdr) != VERSION_TRAMPOLINE || boot_cache_key(hdr, img_path, key) < 0)
+        return -1;
+
+    snprintf(dir, dir_size, "%s/"BOOT_CACHE_DIR"/%s", mrom_dir(), key);
+    if(!boot_cache_file_matches(dir, "zImage", hdr->kernel_size) ||
+        !boot_cache_file_matches(dir, "initrd.img", hdr->ramdisk_size) ||
+        (hdr->dt_size && !boot_cache_file_matches(dir, "dtb.img", hdr->dt_size)))
+    {
+        return -1;
+    }
+
+    // mark as recently used
+    utimes(dir, NULL);
+    return 0;
+}
+
+static int boot_cache_compare_used(const void *a, const void *b)
+{
+    const struct boot_cache_entry *ea = a;
+    const struct boot_cache_entry *eb = b;
+    return (ea->used > eb->used) - (ea->used < eb->used);
+}
+
+static int64_t boot_cache_free_space(const char *path)
+{
+    struct statfs info;
+    if(statfs(path, &info) < 0)
+        return -1;
+    return (int64_t)info.f_bavail * info.f_bsize;
+}
+
+// Removes least recently used entries until there is room for a new one
+static int boot_cache_evict(const char *cache_dir, int64_t needed)
+{
+    DIR *d;
+    struct dirent *dt;
+    struct stat info;
+    char path[256];
+    struct boot_cache_entry *entries = NULL;
+    int cnt = 0, alloc = 0, i;
+    int64_t free_space;
+
+    d = opendir(cache_dir);
+    if(!d)
+        return -1;
+
+    while((dt = readdir(d)))
+    {
+        if(dt->d_name[0] == '.' || strlen(dt->d_name) >= sizeof(entries[0].name))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, dt->d_name);
+        if(stat(path, &info) < 0 || !S_ISDIR(info.st_mode))
+            continue;
+
+        if(cnt == alloc)
+        {
+            alloc = alloc ? alloc*2 : 8;
+            entries = realloc(entries, alloc*sizeof(struct boot_cache_entry));
+        }
+        strcpy(entries[cnt].name, dt->d_name);
+        entries[cnt].used = info.st_mtime;
+        ++cnt;
+    }
+    closedir(d);
+
+    qsort(entries, cnt, sizeof(struct boot_cache_entry), boot_cache_compare_used);
+
+    free_space = boot_cache_free_space(cache_dir);
+    for(i = 0; i < cnt && (cnt - i >= BOOT_CACHE_MAX_ENTRIES || free_space < BOOT_CACHE_MIN_FREE + needed); ++i)
+    {
+        INFO("Removing boot cache entry %s\n", entries[i].name);
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+        remove_dir(path);
+        free_space = boot_cache_free_space(cache_dir);
+    }
+
+    free(entries);
+    return free_space >= BOOT_CACHE_MIN_FREE + needed ? 0 : -1;
+}
+
+// Extracts artifacts of loaded img into the cache, returns 0 and fills dir on success
+static int boot_cache_store(const char *img_path, struct bootimg *img, char *dir, size_t dir_size)
+{
+    char cache_dir[256];
+    char tmp_dir[256];
+    char path[256];
+    char key[BOOT_CACHE_KEY_LEN];
+    struct boot_img_hdr hdr;
+    const int64_t needed = (int64_t)img->hdr.kernel_size + img->hdr.ramdisk_size + img->hdr.dt_size;
+
+    // the key has to match what the next boot sees,
+    // the image might have just been rewritten by inject_bootimg_img
+    if(libbootimg_load_header(&hdr, img_path) < 0 || boot_cache_key(&hdr, img_path, key) < 0 ||
+        hdr.kernel_size != img->hdr.kernel_size || hdr.ramdisk_size != img->hdr.ramdisk_size)
+    {
+        return -1;
+    }
+
+    snprintf(cache_dir, sizeof(cache_dir), "%s/"BOOT_CACHE_DIR, mrom_dir());
+    mkdir(cache_dir, 0700);
+
+    if(boot_cache_evict(cache_dir, needed) < 0)
+    {
+        INFO("Not enough space for boot cache\n");
+        return -1;
+    }
+
+    snprintf(tmp_dir, sizeof(tmp_dir), "%s/.%s", cache_dir, key);
+    remove_dir(tmp_dir);
+    if(mkdir(tmp_dir, 0700) < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/zImage", tmp_dir);
+    if(libbootimg_dump_kernel(img, path) < 0)
+        goto fail;
+
+    snprintf(path, sizeof(path), "%s/initrd.img", tmp_dir);
+    if(libbootimg_dump_ramdisk(img, path) < 0)
+        goto fail;
+
+    if(img->hdr.dt_size)
+    {
+        snprintf(path, sizeof(path), "%s/dtb.img", tmp_dir);
+        if(libbootimg_dump_dtb(img, path) < 0)
+            goto fail;
+    }
+
+    // rename, so that there never is a half-written entry
+    snprintf(dir, dir_size, "%s/%s", cache_dir, key);
+    remove_dir(dir);
+    if(rename(tmp_dir, dir) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    ERROR("Failed to store boot.img artifacts in cache\n");
+    remove_dir(tmp_dir);
+    return -1;
+}
+
+// Checks the trampoline and loads the boot.img, the cmdline is not built
+// here because this runs on the preparation thread too.
+// Updated boot.img is written back only if write is set, otherwise
+// a->needs_write is set and multirom_write_kexec_android_img does it.
+// Nothing is left allocated on failure.
+static int multirom_load_kexec_android_img(const char *base_path, struct kexec_android_img *a, int write)
+{
+    int res;
+    char img_path[256];
+    snprintf(img_path, sizeof(img_path), "%s/boot.img", base_path);
+
+    if(stat(img_path, &a->st) < 0 || libbootimg_init_load(&a->img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
+    {
+        ERROR("fill_kexec could not open boot image (%s)!\n", img_path);
+        return -1;
+    }
 
     // Trampolines in ROM boot images may get out of sync, so we need to check it and
     // update if needed. I can't do that during ZIP installation because of USB drives.
-    if(inject_bootimg(img_path, 0) < 0)
+    // The loaded image is updated too, so it doesn't have to be read again.
+    res = write ? inject_bootimg_img(&a->img, img_path, 0) : inject_bootimg_mem(&a->img, 0);
+    if(res < 0)
     {
         ERROR("Failed to inject bootimg!\n");
+        libbootimg_destroy(&a->img);
         return -1;
     }
+    a->needs_write = (!write && res == 1);
+    return 0;
+}
 
-    struct bootimg img;
-    if(libbootimg_init_load(&img, img_path, LIBBOOTIMG_LOAD_ALL) < 0)
+static int multirom_write_kexec_android_img(const char *base_path, struct kexec_android_img *a)
+{
+    char img_path[256];
+
+    if(!a->needs_write)
+        return 0;
+
+    snprintf(img_path, sizeof(img_path), "%s/boot.img", base_path);
+    if(inject_bootimg_write(&a->img, img_path) < 0)
     {
-        ERROR("fill_kexec could not open boot image (%s)!\n", img_path);
+        ERROR("Failed to write updated boot.img!\n");
         return -1;
     }
+    a->needs_write = 0;
+    return 0;
+}
 
-    if(libbootimg_dump_kernel(&img, "/zImage") < 0)
-        goto exit;
+/*
+ * Loading boot.img takes a while (trampoline check, reading it from possibly
+ * slow USB drive), so it is done on background thread for the ROM which is
+ * selected in the UI, before the user actually presses "Boot".
+ * The preparation never writes to the ROM, updated trampoline is written
+ * only when the ROM is actually booted.
+ */
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    int want_id; // ROM which should be prepared, -1 for none
+    char *want_path;
+    int ready_id; // ROM whose boot.img is in img, -1 for none
+    struct kexec_android_img img;
+} kexec_prep = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .running = 0,
+    .want_id = -1,
+    .want_path = NULL,
+    .ready_id = -1,
+};
+
+static void multirom_kexec_prep_drop_ready(void)
+{
+    if(kexec_prep.ready_id != -1)
+    {
+        libbootimg_destroy(&kexec_prep.img.img);
+        kexec_prep.ready_id = -1;
+    }
+}
 
-    if(libbootimg_dump_ramdisk(&img, "/initrd.img") < 0)
-        goto exit;
+static void *multirom_kexec_prep_work(UNUSED void *data)
+{
+    struct kexec_android_img a;
+    struct boot_img_hdr hdr;
+    char img_path[256];
+    char cache_dir[256];
+    char *path;
+    int id, res;
+
+    pthread_mutex_lock(&kexec_prep.mutex);
+    while(kexec_prep.want_id != -1 && kexec_prep.want_id != kexec_prep.ready_id)
+    {
+        id = kexec_prep.want_id;
+        path = strdup(kexec_prep.want_path);
+        pthread_mutex_unlock(&kexec_prep.mutex);
+
+        snprintf(img_path, sizeof(img_path), "%s/boot.img", path);
+        if(boot_cache_lookup(img_path, &hdr, cache_dir, sizeof(cache_dir)) == 0)
+        {
+            // nothing to prepare, boot.img won't be loaded at all
+            free(path);
+            pthread_mutex_lock(&kexec_prep.mutex);
+            if(kexec_prep.want_id == id)
+                kexec_prep.want_id = -1;
+            continue;
+        }
+
+        res = multirom_load_kexec_android_img(path, &a, 0);
+        free(path);
+
+        pthread_mutex_lock(&kexec_prep.mutex);
+        if(res == 0 && kexec_prep.want_id == id)
+        {
+            INFO("Prepared boot.img of ROM %d for kexec\n", id);
+            kexec_prep.img = a;
+            kexec_prep.ready_id = id;
+        }
+        else
+        {
+            if(res == 0)
+                libbootimg_destroy(&a.img);
+
+            // let multirom_fill_kexec_android try again and report the error
+            if(kexec_prep.want_id == id)
+                kexec_prep.want_id = -1;
+        }
+    }
+    kexec_prep.running = 0;
+    pthread_cond_broadcast(&kexec_prep.cond);
+    pthread_mutex_unlock(&kexec_prep.mutex);
+    return NULL;
+}
+
+void multirom_kexec_prepare(struct multirom_status *s, struct multirom_rom *rom)
+{
+    pthread_t thread;
+    const int can_prepare = rom && rom->type != ROM_DEFAULT && (M(rom->type) & MASK_ANDROID) &&
+            rom->has_bootimg && s->is_second_boot == 0;
+
+    pthread_mutex_lock(&kexec_prep.mutex);
+    if(!can_prepare)
+    {
+        kexec_prep.want_id = -1;
+        multirom_kexec_prep_drop_ready();
+    }
+    else if(kexec_prep.want_id != rom->id)
+    {
+        kexec_prep.want_id = rom->id;
+        free(kexec_prep.want_path);
+        kexec_prep.want_path = strdup(rom->base_path);
+
+        if(kexec_prep.ready_id != rom->id)
+            multirom_kexec_prep_drop_ready();
+
+        if(!kexec_prep.running && pthread_create(&thread, NULL, multirom_kexec_prep_work, NULL) == 0)
+        {
+            pthread_detach(thread);
+            kexec_prep.running = 1;
+        }
+    }
+    pthread_mutex_unlock(&kexec_prep.mutex);
+}
+
+// Takes the prepared boot.img if it belongs to this ROM and did not change since
+static int multirom_kexec_prep_take(struct multirom_rom *rom, struct kexec_android_img *a)
+{
+    int res = -1;
+    char img_path[256];
+    struct stat st;
 
-    kexec_add_kernel(kexec, "/zImage", 1);
-    kexec_add_arg(kexec, "--initrd=/initrd.img");
+    pthread_mutex_lock(&kexec_prep.mutex);
+
+    // it is faster to wait for the running preparation than to start over
+    while(kexec_prep.running && kexec_prep.want_id == rom->id && kexec_prep.ready_id != rom->id)
+        pthread_cond_wait(&kexec_prep.cond, &kexec_prep.mutex);
+
+    if(kexec_prep.ready_id == rom->id)
+    {
+        *a = kexec_prep.img;
+        kexec_prep.ready_id = -1;
+        res = 0;
+    }
+    kexec_prep.want_id = -1;
+    pthread_mutex_unlock(&kexec_prep.mutex);
+
+    if(res == 0)
+    {
+        // run-on-boot scripts might have changed it
+        snprintf(img_path, sizeof(img_path), "%s/boot.img", rom->base_path);
+        if(stat(img_path, &st) < 0 || st.st_ino != a->st.st_ino || st.st_size != a->st.st_size ||
+            st.st_mtime != a->st.st_mtime || st.st_mtime_nsec != a->st.st_mtime_nsec)
+        {
+            INFO("boot.img changed after it was prepared, loading it again\n");
+            libbootimg_destroy(&a->img);
+            res = -1;
+        }
+        else if(multirom_write_kexec_android_img(rom->base_path, a) < 0)
+        {
+            libbootimg_destroy(&a->img);
+            res = -1;
+        }
+    }
+    return res;
+}
+
+// Stops the background thread. Already prepared image is kept,
+// multirom_kexec_prep_take checks that it is still valid.
+void multirom_kexec_prepare_cancel(void)
+{
+    pthread_mutex_lock(&kexec_prep.mutex);
+    kexec_prep.want_id = -1;
+    while(kexec_prep.running)
+        pthread_cond_wait(&kexec_prep.cond, &kexec_prep.mutex);
+    pthread_mutex_unlock(&kexec_prep.mutex);
+}
+
+// Stops the preparation if it reads from dir, which is about to be unmounted
+static void multirom_kexec_prepare_cancel_under(const char *dir)
+{
+    const size_t len = strlen(dir);
+
+    pthread_mutex_lock(&kexec_prep.mutex);
+    if(kexec_prep.want_path && strncmp(kexec_prep.want_path, dir, len) == 0 &&
+        (kexec_prep.want_path[len] == '/' || kexec_prep.want_path[len] == 0))
+    {
+        kexec_prep.want_id = -1;
+        while(kexec_prep.running)
+            pthread_cond_wait(&kexec_prep.cond, &kexec_prep.mutex);
+        multirom_kexec_prep_drop_ready();
+    }
+    pthread_mutex_unlock(&kexec_prep.mutex);
+}
+
+static void multirom_kexec_prepare_free(void)
+{
+    multirom_kexec_prepare_cancel();
+
+    pthread_mutex_lock(&kexec_prep.mutex);
+    multirom_kexec_prep_drop_ready();
+    free(kexec_prep.want_path);
+    kexec_prep.want_path = NULL;
+    pthread_mutex_unlock(&kexec_prep.mutex);
+}
+
+static void multirom_add_kexec_android_args(struct kexec *kexec, const char *dir, int has_dtb, const char *cmdline)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/zImage", dir);
+    kexec_add_kernel(kexec, path, 1);
+
+    snprintf(path, sizeof(path), "%s/initrd.img", dir);
+    kexec_add_arg_prefix(kexec, "--initrd=", path);
 
 #ifdef MR_KEXEC_DTB
-    if(libbootimg_dump_dtb(&img, "/dtb.img") >= 0)
-        kexec_add_arg(kexec, "--dtb=/dtb.img");
+    if(has_dtb)
+    {
+        snprintf(path, sizeof(path), "%s/dtb.img", dir);
+        kexec_add_arg_prefix(kexec, "--dtb=", path);
+    }
     else
         kexec_add_arg(kexec, "--dtb");
 #endif
 
+    kexec_add_arg(kexec, cmdline);
+}
+
+static int multirom_fill_kexec_android_cached(struct multirom_status *s, struct boot_img_hdr *hdr,
+        const char *dir, struct kexec *kexec)
+{
     char cmdline[1536];
-    strcpy(cmdline, "--command-line=");
 
-    if(img.hdr.cmdline[0] != 0)
-    {
-        img.hdr.cmdline[BOOT_ARGS_SIZE-1] = 0;
+    multirom_build_kexec_cmdline(s, hdr, cmdline, sizeof(cmdline));
+    INFO("Using cached boot.img artifacts from %s\n", dir);
 
-        // see multirom_get_bootloader_cmdline
-#if MR_DEVICE_HOOKS >= 5
-        mrom_hook_fixup_bootimg_cmdline((char*)img.hdr.cmdline, BOOT_ARGS_SIZE);
+#ifdef MR_KEXEC_FILE_LOAD
+    if(!hdr->dt_size)
+    {
+        char kernel[256], initrd[256];
+        snprintf(kernel, sizeof(kernel), "%s/zImage", dir);
+        snprintf(initrd, sizeof(initrd), "%s/initrd.img", dir);
+        if(kexec_file_load_path(kexec, kernel, initrd, cmdline + sizeof("--command-line=")-1) == 0)
+            return 0;
+    }
 #endif
 
-        strcat(cmdline, (char*)img.hdr.cmdline);
-        strcat(cmdline, " ");
+    multirom_add_kexec_android_args(kexec, dir, hdr->dt_size != 0, cmdline);
+    return 0;
+}
+
+int multirom_fill_kexec_android(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec)
+{
+    int res = -1;
+    struct kexec_android_img a;
+    struct boot_img_hdr hdr;
+    char img_path[256];
+    char cache_dir[256];
+
+    snprintf(img_path, sizeof(img_path), "%s/boot.img", rom->base_path);
+    if(boot_cache_lookup(img_path, &hdr, cache_dir, sizeof(cache_dir)) == 0)
+        return multirom_fill_kexec_android_cached(s, &hdr, cache_dir, kexec);
+
+    if(multirom_kexec_prep_take(rom, &a) < 0 && multirom_load_kexec_android_img(rom->base_path, &a, 1) < 0)
+        return -1;
+
+    // s->current_rom and the fstab belong to this thread, USB ROMs
+    // may be freed while the preparation runs
+    multirom_build_kexec_cmdline(s, &a.img.hdr, a.cmdline, sizeof(a.cmdline));
+
+#ifdef MR_KEXEC_FILE_LOAD
+    // kexec_file_load can't take the dtb from boot.img, the kernel
+    // reuses the current one
+    if(a.img.blobs[LIBBOOTIMG_BLOB_DTB].data == NULL &&
+        kexec_file_load_mem(kexec, a.img.blobs[LIBBOOTIMG_BLOB_KERNEL].data, *a.img.blobs[LIBBOOTIMG_BLOB_KERNEL].size,
+            a.img.blobs[LIBBOOTIMG_BLOB_RAMDISK].data, *a.img.blobs[LIBBOOTIMG_BLOB_RAMDISK].size,
+            a.cmdline + sizeof("--command-line=")-1) == 0)
+    {
+        // already loaded, the cache would only cost writes
+        res = 0;
+        goto exit;
     }
+#endif
 
-    if(multirom_get_bootloader_cmdline(s, cmdline+strlen(cmdline), sizeof(cmdline)-strlen(cmdline)-1) == -1)
+    if(boot_cache_store(img_path, &a.img, cache_dir, sizeof(cache_dir)) == 0)
     {
-        ERROR("Failed to get cmdline\n");
+        multirom_add_kexec_android_args(kexec, cache_dir, a.img.blobs[LIBBOOTIMG_BLOB_DTB].data != NULL, a.cmdline);
+        res = 0;
         goto exit;
     }
 
-    if(!strstr(cmdline, " mrom_kexecd=1") && sizeof(cmdline)-strlen(cmdline)-1 >= sizeof("mrom_kexecd=1"))
-        strcat(cmdline, "mrom_kexecd=1");
+    // no room for the cache, use rootfs
+    if(libbootimg_dump_kernel(&a.img, "/zImage") < 0)
+        goto exit;
 
-    kexec_add_arg(kexec, cmdline);
+    if(libbootimg_dump_ramdisk(&a.img, "/initrd.img") < 0)
+        goto exit;
+
+#ifdef MR_KEXEC_DTB
+    if(libbootimg_dump_dtb(&a.img, "/dtb.img") < 0)
+        multirom_add_kexec_android_args(kexec, "", 0, a.cmdline);
+    else
+#endif
+        multirom_add_kexec_android_args(kexec, "", 1, a.cmdline);
 
     res = 0;
 exit:
-    libbootimg_destroy(&img);
+    libbootimg_destroy(&a.img);
     return res;
 }
 
@@ -2231,86 +3245,374 @@ void multirom_destroy_partition(void *part)
     free(p);
 }
 
-int multirom_update_partitions(struct multirom_status *s)
+static int multirom_is_internal_blockdev(const char *name)
+{
+    // ignore internal nand
+    return strncmp(name, "mmcblk0", 7) == 0 || strncmp(name, "dm-", 3) == 0;
+}
+
+static int multirom_is_usb_candidate(const char *name)
+{
+    return !multirom_is_internal_blockdev(name);
+}
+
+static struct usb_partition *multirom_new_partition(const char *name, const char *type, const char *uuid)
+{
+    struct usb_partition *part = mzalloc(sizeof(struct usb_partition));
+    part->name = strdup(name);
+    part->fs = strdup(type);
+    part->uuid = strdup(uuid);
+    return part;
+}
+
+static struct usb_partition *multirom_get_partition_by_name(struct multirom_status *s, const char *name)
+{
+    int i;
+    for(i = 0; s->partitions && s->partitions[i]; ++i)
+        if(strcmp(s->partitions[i]->name, name) == 0)
+            return s->partitions[i];
+    return NULL;
+}
+
+// Reserves the device name so that it isn't mounted twice by the uevent
+// thread and a manual refresh. parts_mutex must be held.
+static int multirom_claim_partition(struct multirom_status *s, const char *name)
 {
+    int i;
+    if(multirom_get_partition_by_name(s, name))
+        return 0;
+
+    for(i = 0; usb_mounting && usb_mounting[i]; ++i)
+        if(strcmp(usb_mounting[i], name) == 0)
+            return 0;
+
+    list_add(&usb_mounting, strdup(name));
+    return 1;
+}
+
+// Mounts claimed partition, adds it to the list and lets the UI know,
+// so that its ROMs show up without waiting for the other partitions.
+// parts_mutex must not be held. Returns 0 if the partition was added.
+static int multirom_mount_new_partition(struct multirom_status *s, struct usb_partition *part)
+{
+    int i;
+    int res = multirom_mount_usb(part);
+
     pthread_mutex_lock(&parts_mutex);
+    for(i = 0; usb_mounting && usb_mounting[i]; ++i)
+    {
+        if(strcmp(usb_mounting[i], part->name) == 0)
+        {
+            list_rm_at(&usb_mounting, i, &free);
+            break;
+        }
+    }
 
-    list_clear(&s->partitions, &multirom_destroy_partition);
+    if(res == 0)
+        list_add(&s->partitions, part);
+    pthread_mutex_unlock(&parts_mutex);
 
-    int exit_code = 0;
-    char *cmd[] = { busybox_path, "blkid", NULL };
-    char *res = run_get_stdout_with_exit(cmd, &exit_code);
-    if(exit_code != 0 || res == NULL)
+    if(res == 0)
     {
-        free(res);
-        pthread_mutex_unlock(&parts_mutex);
-        return exit_code == 0 ? 0 : -1;
+        ERROR("Found part %s: %s, %s\n", part->name, part->uuid, part->fs);
+        if(usb_refresh_handler)
+            (*usb_refresh_handler)();
     }
+    else
+    {
+        ERROR("Failed to mount part %s %s, %s\n", part->name, part->uuid, part->fs);
+        multirom_destroy_partition(part);
+    }
+    return res;
+}
 
-    char *tok;
-    char *name;
+struct usb_mount_ctx
+{
+    struct multirom_status *s;
+    struct usb_partition **parts;
+    int next;
+    pthread_mutex_t mutex;
+};
+
+static void *multirom_mount_partitions_work(void *data)
+{
+    struct usb_mount_ctx *ctx = data;
     struct usb_partition *part;
 
-    char *line = strtok(res, "\n");
-    while(line != NULL)
+    while(1)
     {
-        if(strstr(line, "/dev/") != line)
-        {
-            ERROR("blkid line does not start with /dev/!\n");
+        pthread_mutex_lock(&ctx->mutex);
+        part = ctx->parts[ctx->next];
+        if(part)
+            ++ctx->next;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if(!part)
             break;
-        }
 
-        tok = strrchr(line, '/')+1;
-        name = strndup(tok, strchr(tok, ':') - tok);
-        if(strncmp(name, "mmcblk0", 7) == 0 || strncmp(name, "dm-", 3) == 0) // ignore internal nand
-        {
-            free(name);
-            goto next_itr;
-        }
+        multirom_mount_new_partition(ctx->s, part);
+    }
+    return NULL;
+}
 
-        part = mzalloc(sizeof(struct usb_partition));
-        part->name = name;
+// FUSE mounts can take seconds on big drives, so one slow partition
+// must not hold back the others. Returns after all mounts finished.
+static void multirom_mount_partitions(struct multirom_status *s, struct usb_partition **parts)
+{
+    pthread_t threads[USB_MOUNT_THREADS-1];
+    struct usb_mount_ctx ctx = {
+        .s = s,
+        .parts = parts,
+        .next = 0,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+    int i, started = 0;
+    const int cnt = imin(list_item_count(parts), USB_MOUNT_THREADS) - 1;
 
-        tok = strstr(line, "UUID=\"");
-        if(tok)
-        {
-            tok += sizeof("UUID=\"")-1;
-            part->uuid = strndup(tok, strchr(tok, '"') - tok);
-        }
-        else
-        {
-            ERROR("Part %s does not have UUID, line: \"%s\"\n", part->name, line);
-            multirom_destroy_partition(part);
-            goto next_itr;
-        }
+    for(i = 0; i < cnt; ++i)
+        if(pthread_create(&threads[started], NULL, multirom_mount_partitions_work, &ctx) == 0)
+            ++started;
 
-        tok = strstr(line, "TYPE=\"");
-        if(tok)
-        {
-            tok += sizeof("TYPE=\"")-1;
-            part->fs = strndup(tok, strchr(tok, '"') - tok);
-        }
+    multirom_mount_partitions_work(&ctx);
 
-        if(part->fs && multirom_mount_usb(part) == 0)
-        {
-            list_add(&s->partitions, part);
-            ERROR("Found part %s: %s, %s\n", part->name, part->uuid, part->fs);
-        }
-        else
+    for(i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&ctx.mutex);
+}
+
+// Mount of a retired partition, unmounted once parts_mutex is released
+struct usb_retired
+{
+    char *mount_path;
+    int keep_mounted;
+};
+
+// Moves the partition to s->removed_partitions. It can't be freed yet
+// because ROMs still point to it, multirom_find_usb_roms frees it.
+// Its mount is added to retired, for multirom_unmount_retired.
+// parts_mutex must be held.
+static void multirom_retire_partition(struct multirom_status *s, struct usb_partition *p,
+        struct usb_retired ***retired)
+{
+    struct usb_retired *r;
+
+    ERROR("Removed part %s: %s\n", p->name, p->uuid);
+
+    if(p->mount_path)
+    {
+        r = mzalloc(sizeof(struct usb_retired));
+        r->mount_path = p->mount_path;
+        r->keep_mounted = p->keep_mounted;
+        list_add(retired, r);
+        p->mount_path = NULL;
+    }
+
+    list_rm_noreorder(&s->partitions, p, NULL);
+    list_add(&s->removed_partitions, p);
+}
+
+// parts_mutex must not be held, waiting for the kexec preparation
+// which reads from the mount could take a while.
+static void multirom_unmount_retired(struct usb_retired **retired)
+{
+    int i;
+    for(i = 0; retired && retired[i]; ++i)
+    {
+        multirom_kexec_prepare_cancel_under(retired[i]->mount_path);
+        if(retired[i]->keep_mounted == 0)
+            umount(retired[i]->mount_path);
+        free(retired[i]->mount_path);
+    }
+    list_clear(&retired, &free);
+}
+
+// Drops partitions which are gone and claims the new ones,
+// returns the claimed partitions which still have to be mounted.
+static struct usb_partition **multirom_sync_partitions(struct multirom_status *s)
+{
+    int i, x;
+    int removed = 0;
+    struct blkprobe_dev **devs;
+    struct usb_partition *p;
+    struct usb_partition **known = NULL;
+    struct usb_partition **add = NULL;
+    struct usb_retired **retired = NULL;
+
+    // Probing reads every block device, which can be slow. Partitions
+    // mounted in the meantime are not in the snapshot and are kept.
+    pthread_mutex_lock(&parts_mutex);
+    for(i = 0; s->partitions && s->partitions[i]; ++i)
+        list_add(&known, s->partitions[i]);
+    pthread_mutex_unlock(&parts_mutex);
+
+    devs = blkprobe_scan(&multirom_is_usb_candidate);
+
+    pthread_mutex_lock(&parts_mutex);
+
+    // drop partitions which disappeared or were reformatted
+    for(i = 0; known && known[i]; ++i)
+    {
+        p = known[i];
+        if(!multirom_has_partition(s, p))
+            continue;
+
+        for(x = 0; devs && devs[x]; ++x)
+            if(strcmp(devs[x]->name, p->name) == 0 && strcmp(devs[x]->uuid, p->uuid) == 0)
+                break;
+
+        if(!devs || !devs[x])
         {
-            ERROR("Failed to mount part %s %s, %s\n", part->name, part->uuid, part->fs);
-            multirom_destroy_partition(part);
+            multirom_retire_partition(s, p, &retired);
+            ++removed;
         }
+    }
 
-next_itr:
-        line = strtok(NULL, "\n");
+    // mount only the new ones
+    for(i = 0; devs && devs[i]; ++i)
+    {
+        if(multirom_claim_partition(s, devs[i]->name))
+            list_add(&add, multirom_new_partition(devs[i]->name, devs[i]->type, devs[i]->uuid));
     }
+
     pthread_mutex_unlock(&parts_mutex);
-    free(res);
+    list_clear(&known, NULL);
+    list_clear(&devs, &blkprobe_dev_free);
+
+    multirom_unmount_retired(retired);
+
+    if(removed && usb_refresh_handler)
+        (*usb_refresh_handler)();
 
+    return add;
+}
+
+int multirom_update_partitions(struct multirom_status *s)
+{
+    struct usb_partition **add = multirom_sync_partitions(s);
+    if(add)
+    {
+        multirom_mount_partitions(s, add);
+        list_clear(&add, NULL);
+    }
     return 0;
 }
 
+// Probes single block device, returns NULL if it is already known or unusable
+static struct usb_partition *multirom_probe_usb_blockdev(struct multirom_status *s, const char *name)
+{
+    int claimed;
+    char src[256];
+    char type[BLKPROBE_TYPE_LEN];
+    char uuid[BLKPROBE_UUID_LEN];
+    struct stat info;
+    int tries;
+
+    snprintf(src, sizeof(src), "/dev/block/%s", name);
+
+    // The uevent arrives to us at the same time as to the trampoline's
+    // ueventd, so the node might not exist yet
+    for(tries = 0; stat(src, &info) < 0 && tries < USB_DEV_WAIT_TRIES && run_usb_refresh; ++tries)
+        usleep(50000);
+
+    if(blkprobe_path(src, type, uuid) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&parts_mutex);
+    claimed = multirom_claim_partition(s, name);
+    pthread_mutex_unlock(&parts_mutex);
+
+    return claimed ? multirom_new_partition(name, type, uuid) : NULL;
+}
+
+struct usb_add_job
+{
+    struct multirom_status *s;
+    char **names;                // probed and claimed first
+    struct usb_partition **parts; // already claimed
+};
+
+static void *multirom_add_usb_blockdevs_work(void *data)
+{
+    struct usb_add_job *job = data;
+    struct usb_partition *part;
+    int i;
+
+    for(i = 0; job->names && job->names[i] && run_usb_refresh; ++i)
+    {
+        part = multirom_probe_usb_blockdev(job->s, job->names[i]);
+        if(part)
+            list_add(&job->parts, part);
+    }
+
+    // the same parallel, deadline-bounded mounting as a full refresh
+    if(job->parts)
+    {
+        multirom_mount_partitions(job->s, job->parts);
+        list_clear(&job->parts, NULL);
+    }
+
+    list_clear(&job->names, &free);
+    free(job);
+
+    pthread_mutex_lock(&usb_add_jobs_mutex);
+    --usb_add_jobs;
+    pthread_cond_broadcast(&usb_add_jobs_cond);
+    pthread_mutex_unlock(&usb_add_jobs_mutex);
+    return NULL;
+}
+
+// Mounts hotplugged block devices off the refresh thread, so that
+// a slow FUSE mount doesn't hold back other uevents or stopping.
+// Takes ownership of names and parts, either can be NULL.
+// usb_refresh_handler is notified per partition.
+static void multirom_add_usb_blockdevs(struct multirom_status *s, char **names,
+        struct usb_partition **parts)
+{
+    pthread_t thread;
+    struct usb_add_job *job = mzalloc(sizeof(struct usb_add_job));
+    job->s = s;
+    job->names = names;
+    job->parts = parts;
+
+    pthread_mutex_lock(&usb_add_jobs_mutex);
+    ++usb_add_jobs;
+    pthread_mutex_unlock(&usb_add_jobs_mutex);
+
+    if(pthread_create(&thread, NULL, multirom_add_usb_blockdevs_work, job) == 0)
+        pthread_detach(thread);
+    else
+        multirom_add_usb_blockdevs_work(job);
+}
+
+static void multirom_wait_usb_add_jobs(void)
+{
+    pthread_mutex_lock(&usb_add_jobs_mutex);
+    while(usb_add_jobs > 0)
+        pthread_cond_wait(&usb_add_jobs_cond, &usb_add_jobs_mutex);
+    pthread_mutex_unlock(&usb_add_jobs_mutex);
+}
+
+// Unmounts single block device, returns 1 if the partition list changed
+static int multirom_remove_usb_blockdev(struct multirom_status *s, const char *name)
+{
+    int res = 0;
+    struct usb_partition *part;
+    struct usb_retired **retired = NULL;
+
+    pthread_mutex_lock(&parts_mutex);
+    part = multirom_get_partition_by_name(s, name);
+    if(part)
+    {
+        multirom_retire_partition(s, part, &retired);
+        res = 1;
+    }
+    pthread_mutex_unlock(&parts_mutex);
+
+    multirom_unmount_retired(retired);
+    return res;
+}
+
 int multirom_mount_usb(struct usb_partition *part)
 {
     mkdir("/mnt", 0777);
@@ -2329,18 +3631,20 @@ int multirom_mount_usb(struct usb_partition *part)
     if(strncmp(part->fs, "ntfs", 4) == 0)
     {
         char *cmd[] = { ntfs_path, src, path, NULL };
-        if(run_cmd(cmd) != 0)
+        if(run_cmd_timeout(cmd, USB_MOUNT_TIMEOUT_NTFS) != 0)
         {
             ERROR("Failed to mount %s with ntfs-3g\n", src);
+            umount2(path, MNT_DETACH);
             return -1;
         }
     }
     else if(strcmp(part->fs, "exfat") == 0)
     {
         char *cmd[] = { exfat_path, "-o", "big_writes,max_read=131072,max_write=131072,nonempty", src, path, NULL };
-        if(run_cmd(cmd) != 0)
+        if(run_cmd_timeout(cmd, USB_MOUNT_TIMEOUT_EXFAT) != 0)
         {
             ERROR("Failed to mount %s with exfat\n", src);
+            umount2(path, MNT_DETACH);
             return -1;
         }
     }
@@ -2354,37 +3658,156 @@ int multirom_mount_usb(struct usb_partition *part)
     return 0;
 }
 
+// Returns 1 if a partition was removed. Names of added devices are
+// collected in added, they are mounted once the queue is drained.
+static int multirom_handle_usb_uevent(struct multirom_status *s, char *msg, int len, char ***added)
+{
+    const char *action = NULL;
+    const char *subsystem = NULL;
+    const char *devname = NULL;
+    char *end = msg + len;
+
+    // "action@devpath\0KEY=value\0KEY=value\0..."
+    while(msg < end && *msg)
+    {
+        if(strncmp(msg, "ACTION=", 7) == 0)
+            action = msg + 7;
+        else if(strncmp(msg, "SUBSYSTEM=", 10) == 0)
+            subsystem = msg + 10;
+        else if(strncmp(msg, "DEVNAME=", 8) == 0)
+            devname = msg + 8;
+
+        msg += strlen(msg) + 1;
+    }
+
+    if(!action || !subsystem || !devname || strcmp(subsystem, "block") != 0)
+        return 0;
+
+    // DEVNAME might be "block/sda1" on some kernels
+    if(strrchr(devname, '/'))
+        devname = strrchr(devname, '/') + 1;
+
+    if(multirom_is_internal_blockdev(devname) ||
+        strncmp(devname, "loop", 4) == 0 || strncmp(devname, "ram", 3) == 0)
+    {
+        return 0;
+    }
+
+    if(strcmp(action, "add") == 0)
+        list_add(added, strdup(devname));
+    else if(strcmp(action, "remove") == 0)
+    {
+        int i;
+        for(i = 0; *added && (*added)[i]; ++i)
+        {
+            if(strcmp((*added)[i], devname) == 0)
+            {
+                list_rm_at(added, i, &free);
+                break;
+            }
+        }
+        return multirom_remove_usb_blockdev(s, devname);
+    }
+    return 0;
+}
+
 void *multirom_usb_refresh_thread_work(void *status)
 {
-    uint32_t timer = 0;
-    struct stat info;
+    struct multirom_status *s = (struct multirom_status*)status;
+    struct pollfd fds[2];
+    char msg[USB_UEVENT_MSG_LEN+2];
+    char **added = NULL;
+    struct usb_partition **resync = NULL;
+    struct usb_partition **found;
+    int n, changed;
+
+    int uevent_fd = uevent_open_socket(64*1024, true);
+    if(uevent_fd < 0)
+        ERROR("Failed to open uevent socket: %s\n", strerror(errno));
+    else
+    {
+        // the queue is drained until EAGAIN, it must not block there
+        fcntl(uevent_fd, F_SETFD, FD_CLOEXEC);
+        fcntl(uevent_fd, F_SETFL, O_NONBLOCK);
+    }
+
+    // Anything plugged in before the socket was opened, mounted
+    // in the background like the hotplugged ones
+    resync = multirom_sync_partitions(s);
+    if(resync)
+    {
+        multirom_add_usb_blockdevs(s, NULL, resync);
+        resync = NULL;
+    }
+    if(usb_refresh_handler)
+        (*usb_refresh_handler)();
 
-    // stat.st_ctime is defined as unsigned long instead
-    // of time_t in android
-    unsigned long last_ctime = 0;
-    unsigned long last_ctime_nsec = 0;
+    fds[0].fd = usb_refresh_wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = uevent_fd;
+    fds[1].events = POLLIN;
 
     while(run_usb_refresh)
     {
-        if(timer <= 50)
+        if(poll(fds, uevent_fd >= 0 ? 2 : 1, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ERROR("USB refresh poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if(!run_usb_refresh || !(fds[1].revents & POLLIN))
+            continue;
+
+        changed = 0;
+        while(1)
         {
-            if (stat("/dev/block", &info) >= 0 &&
-                (info.st_ctime != last_ctime || info.st_ctime_nsec != last_ctime_nsec))
+            n = uevent_kernel_multicast_recv(uevent_fd, msg, USB_UEVENT_MSG_LEN);
+            if(n < 0)
             {
-                multirom_update_partitions((struct multirom_status*)status);
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+
+                // some events were lost, find out what is there now
+                if(errno == ENOBUFS)
+                {
+                    found = multirom_sync_partitions(s);
+                    list_add_from_list(&resync, found);
+                    list_clear(&found, NULL);
+                    changed = 1;
+                    continue;
+                }
 
-                if(usb_refresh_handler)
-                    (*usb_refresh_handler)();
+                // EIO is a message which was not sent by the kernel
+                if(errno == EIO || errno == EINTR)
+                    continue;
 
-                last_ctime = info.st_ctime;
-                last_ctime_nsec = info.st_ctime_nsec;
+                ERROR("Failed to receive uevent: %s\n", strerror(errno));
+                break;
             }
-            timer = 500;
+
+            if(n == 0 || n >= USB_UEVENT_MSG_LEN) // overflow -- discard
+                continue;
+
+            msg[n] = '\0';
+            msg[n+1] = '\0';
+            changed |= multirom_handle_usb_uevent(s, msg, n, &added);
+        }
+
+        if(changed && usb_refresh_handler)
+            (*usb_refresh_handler)();
+
+        if(added || resync)
+        {
+            multirom_add_usb_blockdevs(s, added, resync);
+            added = NULL;
+            resync = NULL;
         }
-        else
-            timer -= 50;
-        usleep(50000);
     }
+
+    if(uevent_fd >= 0)
+        close(uevent_fd);
     return NULL;
 }
 
@@ -2393,11 +3816,27 @@ void multirom_set_usb_refresh_thread(struct multirom_status *s, int run)
     if(run_usb_refresh == run)
         return;
 
-    run_usb_refresh = run;
     if(run)
+    {
+        if(usb_refresh_wake_fd < 0)
+            usb_refresh_wake_fd = eventfd(0, EFD_NONBLOCK);
+
+        uint64_t val;
+        while(read(usb_refresh_wake_fd, &val, sizeof(val)) > 0);
+
+        run_usb_refresh = run;
         pthread_create(&usb_refresh_thread, NULL, multirom_usb_refresh_thread_work, s);
+    }
     else
+    {
+        uint64_t val = 1;
+        run_usb_refresh = run;
+        write(usb_refresh_wake_fd, &val, sizeof(val));
         pthread_join(usb_refresh_thread, NULL);
+
+        // mounts have deadlines, this doesn't take long
+        multirom_wait_usb_add_jobs();
+    }
 }
 
 void multirom_set_usb_refresh_handler(void (*handler)(void))
@@ -57,6 +57,7 @@ enum
     EXIT_REBOOT_BOOTLOADER   = 0x08,
     EXIT_SHUTDOWN            = 0x10,
     EXIT_KEXEC               = 0x20,
+    EXIT_KEXEC_LOADED        = 0x40, // kernel was loaded in-process by kexec_file_load
 
     EXIT_REBOOT_MASK         = (EXIT_REBOOT | EXIT_REBOOT_RECOVERY | EXIT_REBOOT_BOOTLOADER | EXIT_SHUTDOWN),
 };
@@ -76,6 +77,7 @@ struct usb_partition
     char *uuid;
     char *fs;
     int keep_mounted;
+    int scanned; // for ROMs
 };
 
 struct rom_info {
@@ -108,10 +110,14 @@ struct multirom_status
     int rotation;
     int force_generic_fb;
     float anim_duration_coef;
+    int anim_frame_sync;
+    int input_record;
+    int input_replay_speed_pct;
     struct multirom_rom *auto_boot_rom;
     struct multirom_rom *current_rom;
     struct multirom_rom **roms;
     struct usb_partition **partitions;
+    struct usb_partition **removed_partitions; // until their ROMs are dropped
     char *curr_rom_part;
     struct fstab *fstab;
 };
@@ -146,6 +152,8 @@ int multirom_get_bootloader_cmdline(struct multirom_status *s, char *str, size_t
 int multirom_find_file(char *res, const char *name_part, const char *path);
 int multirom_fill_kexec_linux(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec);
 int multirom_fill_kexec_android(struct multirom_status *s, struct multirom_rom *rom, struct kexec *kexec);
+void multirom_kexec_prepare(struct multirom_status *s, struct multirom_rom *rom);
+void multirom_kexec_prepare_cancel(void);
 int multirom_extract_bytes(const char *dst, FILE *src, size_t size);
 int multirom_update_partitions(struct multirom_status *s);
 void multirom_destroy_partition(void *part);
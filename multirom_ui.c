@@ -36,6 +36,7 @@
 #include "lib/notification_card.h"
 #include "lib/tabview.h"
 #include "lib/colors.h"
+#include "lib/mrom_data.h"
 
 #include "multirom_ui.h"
 #include "multirom_ui_themes.h"
@@ -131,6 +132,10 @@ int multirom_ui(struct multirom_status *s, struct multirom_rom **to_boot)
 
     mrom_status = s;
 
+    // most likely to be booted, start loading it while the UI comes up
+    if(s->auto_boot_rom)
+        multirom_kexec_prepare(s, s->auto_boot_rom);
+
     exit_ui_code = -1;
     selected_rom = NULL;
 
@@ -154,10 +159,21 @@ int multirom_ui(struct multirom_status *s, struct multirom_rom **to_boot)
     }
 
     workers_start();
+    anim_set_step_mode(s->anim_frame_sync ? ANIM_STEP_FRAME : ANIM_STEP_WORKER);
     anim_init(s->anim_duration_coef);
 
     multirom_ui_init_theme(TAB_INTERNAL);
 
+    if(s->input_replay_speed_pct > 0 || s->input_record)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/input.rec", mrom_dir());
+        if(s->input_replay_speed_pct > 0)
+            input_set_replay(path, s->input_replay_speed_pct);
+        else
+            input_record_start(path);
+    }
+
     start_input_thread();
     keyaction_enable(1);
 
@@ -508,6 +524,7 @@ void *multirom_ui_tab_rom_init(int tab_type)
     t->list->item_height = &rom_item_height;
     t->list->item_destroy = &rom_item_destroy;
     t->list->item_confirmed = &multirom_ui_tab_rom_confirmed;
+    t->list->item_selected = &multirom_ui_tab_rom_selected;
 
     cur_theme->tab_rom_init(themes_info->data, t, tab_type);
 
@@ -557,6 +574,13 @@ void multirom_ui_tab_rom_confirmed(UNUSED listview_item *it)
     multirom_ui_tab_rom_boot();
 }
 
+void multirom_ui_tab_rom_selected(UNUSED listview_item *prev, listview_item *now)
+{
+    // NULL comes from list refreshes, keep whatever is being prepared
+    if(now)
+        multirom_kexec_prepare(mrom_status, multirom_get_rom_by_id(mrom_status, now->id));
+}
+
 void multirom_ui_tab_rom_boot(void)
 {
     int cur_tab = themes_info->data->selected_tab;
@@ -613,10 +637,25 @@ void multirom_ui_tab_rom_boot(void)
 
 void multirom_ui_tab_rom_update_usb(void)
 {
+    int i;
     tab_data_roms *t = (tab_data_roms*)themes_info->data->tab_data[TAB_USB];
+
+    // ROM ids stay the same for drives which weren't unplugged, keep the selection
+    const int selected_id = t->list->selected ? t->list->selected->id : -1;
+
     listview_clear(t->list);
 
     multirom_ui_fill_rom_list(t->list, MASK_USB_ROMS);
+
+    for(i = 0; selected_id != -1 && t->list->items && t->list->items[i]; ++i)
+    {
+        if(t->list->items[i]->id == selected_id)
+        {
+            listview_select_item(t->list, t->list->items[i]);
+            break;
+        }
+    }
+
     listview_update_ui(t->list);
 
     multirom_ui_tab_rom_set_empty(t, (int)(t->list->items == NULL));
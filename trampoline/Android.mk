@@ -12,7 +12,7 @@ LOCAL_MODULE_TAGS := eng
 
 LOCAL_MODULE_PATH := $(TARGET_ROOT_OUT)
 LOCAL_UNSTRIPPED_PATH := $(TARGET_ROOT_OUT_UNSTRIPPED)
-LOCAL_STATIC_LIBRARIES := libcutils libc libmultirom_static libbootimg
+LOCAL_STATIC_LIBRARIES := libcutils libc libmultirom_static libbootimg libz
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 ifeq ($(MR_INIT_DEVICES),)